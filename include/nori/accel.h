@@ -18,20 +18,41 @@
 
 #pragma once
 
-#include <nori/mesh.h>
-#include <nori/octreenode.h>
-#include <stack>
+#include <nori/instance.h>
+#include <nori/accelcache.h>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
- * The current implementation falls back to a brute force loop
- * through the geometry.
+ * This is the abstract interface of the acceleration data structures that
+ * can be selected in the scene description, e.g. using
+ * <tt>&lt;accel type="bvh"/&gt;</tt> or <tt>&lt;accel type="octree"/&gt;</tt>.
+ * When no acceleration data structure is specified, the scene falls back
+ * to a bounding volume hierarchy.
+ *
+ * The acceleration data structure is organized in two levels: subclasses
+ * build a separate bottom-level structure over the triangles of each shape
+ * (i.e. each distinct mesh that stores triangles), and this class maintains
+ * a small top-level bounding volume hierarchy over the meshes, which
+ * dispatches ray queries to the bottom-level structures. Instances (see
+ * \ref Instance) share the bottom-level structure of the mesh they refer to
+ * and are intersected by transforming the ray into its object space.
+ *
+ * All acceleration data structures accept a boolean \c watertight property
+ * (default: \c false). When set, leaves use the watertight ray-triangle test
+ * (see \ref WatertightRay), which never lets a ray slip through the shared
+ * edges or vertices of adjacent triangles, instead of the slightly faster
+ * Moeller-Trumbore test. They also accept a \c cacheDirectory string
+ * (relative paths refer to the directory of the scene file), in which the
+ * bottom-level structures are cached across runs (see \ref AccelCache).
  */
-class Accel {
+class Accel : public NoriObject {
 public:
+    /// Release all memory
+    virtual ~Accel() { }
+
     /**
      * \brief Register a triangle mesh for inclusion in the acceleration
      * data structure
@@ -40,182 +61,245 @@ public:
      */
     void addMesh(Mesh *mesh);
 
-    /// Build the acceleration data structure (currently a no-op)
-    void build();
-
-    unsigned int MIN_TRI = 16;
-    int MAX_DEPTH = 8;
-    int total_leaf = 0;
-    int total_interior = 0; 
-    
-    std::vector<int> triangle_idx;
-
-    void init_triangle_idx(size_t size) 
-    {
-        for(size_t i = 0; i < size; ++i)
-        {
-            this->triangle_idx.push_back(i); 
-        }
-    }
-
-    bool checkLeaf(const OctreeBaseNode* node) const
-    {
-        //check node {leaf, interior}
-        bool res = false;
-        for(size_t i = 0; i < 8; ++i)
-        {
-            if(node->children[i])
-            {
-                res = true;
-            }
-        }
-        return !res;
-    }
-    OctreeBaseNode* build(const BoundingBox3f& bbox, std::vector<int>& triangle_idx, int* leaf, int* interior)
-    {
-        fprintf(stdout, "leaf %d; node %d\n", (*leaf), (*interior));
-        if(triangle_idx.size() < MIN_TRI)
-        {
-            OctreeBaseNode* node = new OctreeLeaf(bbox, triangle_idx);
-            (*leaf)++;
-            return node;
-        }
-        OctreeBaseNode* root = new OctreeNode(bbox, triangle_idx);
-        std::stack<OctreeBaseNode*> dfs_stack;
-        dfs_stack.push(root);
-        (*interior)++;
-        while(!dfs_stack.empty())
-        {
-            auto top = dfs_stack.top();
-            if(top->m_triangle_idx.size() == 0 || top->visited)
-            {
-                dfs_stack.pop();
-                continue;
-            }
-            if(top->m_triangle_idx.size() < MIN_TRI ||
-            (top->parent && top->parent->depth > MAX_DEPTH))
-            {
-                // this is a leaf node     
-                OctreeBaseNode* leaf_node = new OctreeLeaf(top->m_bbox, top->m_triangle_idx);
-                leaf_node->depth = top->depth;
-                leaf_node->child_id = top->child_id;
-                (*leaf)++;
-                (*interior)--;
-                assert(leaf_node->depth == top->parent->depth + 1);
-                if(top->parent)
-                {
-                    top->parent->children[top->child_id] = leaf_node;
-                }
-                else fprintf(stdout, "WTF\n");
-                top->m_triangle_idx.clear();
-                top->m_triangle_idx.shrink_to_fit();
-                dfs_stack.pop();
-                continue;
-            }
-            std::vector<int> triangle_list[8]; 
-            BoundingBox3f sub_bbox[8];
-            calSubBox(top->m_bbox, sub_bbox);
-            for(size_t i = 0; i < top->m_triangle_idx.size(); ++i)
-            {
-                const auto &box = m_mesh->getBoundingBox(top->m_triangle_idx[i]);
-                for(size_t j = 0; j < 8; ++j)
-                {
-                    if(sub_bbox[j].overlaps(box))
-                    {
-                        triangle_list[j].push_back(top->m_triangle_idx[i]);
-                    }
-                }
-            }
-            for(size_t i = 0; i < 8; ++i)
-            {
-                OctreeBaseNode* n = new OctreeNode(sub_bbox[i], triangle_list[i]);
-                n->child_id = i;
-                n->parent = top;
-                n->depth = top->depth + 1;
-                top->children[i] = n;
-                (*interior)++;
-                dfs_stack.push(n);
-            }
-            top->visited = true;
-            top->m_triangle_idx.clear();
-            top->m_triangle_idx.shrink_to_fit();
+    /**
+     * \brief Build the acceleration data structure
+     *
+     * Implementations build the bottom-level structures of all meshes and
+     * then call \ref buildTopLevel().
+     */
+    virtual void build() = 0;
 
-        }
-        fprintf(stdout, "leaf %d; interior %d;\n", (*leaf), (*interior));
-        return root;
-//        return root;
-        //recursive version
-        //std::vector<int> triangle_list[8];
-        //BoundingBox3f sub_bbox[8];
-        //calSubBox(bbox, sub_bbox);
-
-        //for(size_t i = 0; i < triangle_idx.size(); ++i)
-        //{
-        //    BoundingBox3f box = m_mesh->getBoundingBox(triangle_idx[i]);
-        //    for(size_t j = 0; j < 8; ++j)
-        //    {
-        //        if(box.overlaps(sub_bbox[j]))
-        //        {
-        //            triangle_list[j].push_back(triangle_idx[i]);
-        //        }
-        //    }
-        //}       
-        //(*interior)++;
-        //OctreeBaseNode* node = new OctreeNode(bbox, triangle_idx);
-        //for(size_t i = 0; i < 8; ++i)
-        //{
-        //    node->children[i] = this->build(sub_bbox[i], triangle_list[i], leaf, interior);
-        //    node->children[i]->depth = node->depth + 1;
-        //}
-        //return node;
-    }
-
-    void calSubBox(const BoundingBox3f& bbox, BoundingBox3f* sub_bbox) const
-    {
-        Vector3f len = bbox.getExtents();
-        len /= 2.0;
-        Point3f min = bbox.min;
-        Point3f max = bbox.max;
-        sub_bbox[0] = BoundingBox3f(Point3f(min[0], min[1], min[2]), Point3f(min[0] + len[0], min[1] + len[1], min[2] + len[2]));
-        sub_bbox[1] = BoundingBox3f(Point3f(min[0] + len[0], min[1], min[2]), Point3f(max[0], min[1] + len[1], min[2] + len[2]));
-        sub_bbox[2] = BoundingBox3f(Point3f(min[0] + len[0], min[1] + len[1], min[2]), Point3f(max[0], max[1], min[2] + len[2]));
-        sub_bbox[3] = BoundingBox3f(Point3f(min[0], min[1] + len[1], min[2]), Point3f(min[0] + len[0], max[1], min[2] + len[2]));
-        sub_bbox[4] = BoundingBox3f(Point3f(min[0], min[1], min[2] + len[2]), Point3f(min[0] + len[0], min[1] + len[1], max[2]));
-        sub_bbox[5] = BoundingBox3f(Point3f(min[0] + len[0], min[1], min[2] + len[2]), Point3f(max[0], min[1] + len[1], max[2]));
-        sub_bbox[6] = BoundingBox3f(Point3f(min[0] + len[0], min[1] + len[1], min[2] + len[2]), Point3f(max[0], max[1], max[2]));
-        sub_bbox[7] = BoundingBox3f(Point3f(min[0], min[1] + len[1], min[2] + len[2]), Point3f(min[0] + len[0], max[1], max[2]));
-    }
+    /**
+     * \brief Update the acceleration data structure after the vertex
+     * positions of its meshes have changed
+     *
+     * See \ref Mesh::setVertexPositions(). The default implementation
+     * rebuilds the acceleration data structure from scratch. Subclasses can
+     * instead keep their topology and only update the bounds of the nodes,
+     * which is much faster.
+     */
+    virtual void refit();
+
+    /// Return the number of meshes (including instances)
+    uint32_t getMeshCount() const { return (uint32_t) m_meshes.size(); }
+
+    /// Return the number of shapes, i.e. the number of bottom-level structures
+    uint32_t getShapeCount() const { return (uint32_t) m_shapes.size(); }
 
     /// Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
-    int getTriCount() const { return m_mesh->getTriangleCount();}
+
+    /// Does this acceleration data structure use the watertight ray-triangle test?
+    bool isWatertight() const { return m_watertight; }
+
+    /// Return the on-disk cache of the bottom-level structures
+    const AccelCache &getCache() const { return m_cache; }
+
+    /// Replace the on-disk cache (takes effect on the next call to \ref build())
+    void setCache(const AccelCache &cache) { m_cache = cache; }
+
+    /// Return the number of shapes that the last call to \ref build() loaded from the cache
+    uint32_t getCachedShapeCount() const { return m_cachedCount; }
 
     /**
-     * \brief Intersect a ray against all triangles stored in the scene and
-     * return detailed intersection information
+     * \brief Find the closest intersection of a ray with the triangles
+     * stored in the scene
      *
      * \param ray
      *    A 3-dimensional ray data structure with minimum/maximum extent
      *    information
      *
-     * \param its
-     *    A detailed intersection record, which will be filled by the
-     *    intersection query
+     * \param pi
+     *    A compact intersection record, which will be filled by the
+     *    intersection query. Use \ref computeIntersection() to obtain
+     *    detailed information.
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, PreliminaryIntersection &pi) const;
+
+    /**
+     * \brief Intersect a ray against all triangles stored in the scene and
+     * return detailed intersection information
      *
-     * \param shadowRay
-     *    \c true if this is a shadow ray query, i.e. a query that only aims to
-     *    find out whether the ray is blocked or not without returning detailed
-     *    intersection information.
+     * Equivalent to \ref rayIntersect(const Ray3f &, PreliminaryIntersection &) const
+     * followed by \ref computeIntersection().
      *
      * \return \c true if an intersection was found
      */
-    bool rayIntersect(const Ray3f& ray, Intersection& its, bool shadowray) const; 
-    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay, OctreeBaseNode* root) const;
-    
+    bool rayIntersect(const Ray3f &ray, Intersection &its) const;
+
+    /**
+     * \brief Find the closest intersections of a stream of rays
+     *
+     * Equivalent to calling \ref rayIntersect(const Ray3f &, PreliminaryIntersection &) const
+     * for each ray, but groups of up to \ref RayStreamSize rays are
+     * traversed together: each node is fetched once per group and tested
+     * against all rays that reached it. This pays off for coherent rays,
+     * such as the camera rays of an image block.
+     *
+     * \param count
+     *    Number of rays
+     * \param rays
+     *    Array of \c count rays
+     * \param pi
+     *    Array of \c count compact intersection records, which will be
+     *    filled by the query. The \c mesh field of rays that do not hit
+     *    anything is set to \c nullptr.
+     */
+    void rayIntersect(uint32_t count, const Ray3f *rays, PreliminaryIntersection *pi) const;
+
+    /**
+     * \brief Compute the detailed intersection record for a compact one
+     *
+     * This computes the position, texture coordinates, and the geometric
+     * and shading frames in world space.
+     */
+    void computeIntersection(const PreliminaryIntersection &pi, Intersection &its) const;
+
+    /**
+     * \brief Determine whether the ray is blocked by any triangle within
+     * <tt>[ray.mint, ray.maxt]</tt> (shadow ray query)
+     *
+     * Unlike \ref rayIntersect(), this query visits nodes in an arbitrary
+     * order, does not shrink the ray, and terminates at the first
+     * intersection that is found.
+     */
+    bool occluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Return the type of object (i.e. Mesh/BSDF/etc.)
+     * provided by this instance
+     * */
+    EClassType getClassType() const { return EAccel; }
+
+    /// Maximum number of rays that are traversed together by the stream query (one bit per ray in a 64-bit mask)
+    static const uint32_t RayStreamSize = 64;
+
+protected:
+    /// Initialize the properties that are shared by all acceleration data structures
+    Accel(const PropertyList &propList);
+
+    /**
+     * \brief Intersect a ray against the triangles of a single shape
+     *
+     * Only intersections closer than <tt>ray.maxt</tt> are reported. When
+     * one is found, the implementation shrinks <tt>ray.maxt</tt> to its
+     * distance and sets the \c t, \c uv (barycentric) and \c f fields
+     * of \c pi.
+     */
+    virtual bool rayIntersectShape(uint32_t shapeIdx, Ray3f &ray,
+                                   PreliminaryIntersection &pi) const = 0;
+
+    /// Check whether any triangle of a single shape blocks the ray (see \ref occluded())
+    virtual bool occludedShape(uint32_t shapeIdx, const Ray3f &ray) const = 0;
+
+    /**
+     * \brief Intersect a stream of rays against the triangles of a single
+     * shape (see \ref rayIntersect(uint32_t, const Ray3f *, PreliminaryIntersection *) const)
+     *
+     * Only the rays whose bits are set in the mask \c active are
+     * intersected. The default implementation calls \ref rayIntersectShape()
+     * for each of them.
+     *
+     * \return A mask of the rays that found a closer intersection
+     */
+    virtual uint64_t rayIntersectShapeStream(uint32_t shapeIdx, Ray3f *rays, PreliminaryIntersection *pi,
+                                             uint64_t active) const;
+
+    /// Build the top-level hierarchy over the bounding boxes of all meshes
+    void buildTopLevel();
+
+    /// Update the bounding boxes of the instances and of the scene (see \ref refit())
+    void updateBoundingBoxes();
+
+    /**
+     * \brief Statistics about the bottom-level structures, which are
+     * collected during the build and summarized by \ref printBuildReport()
+     *
+     * The statistics of each shape are stored in the cache along with its
+     * structure, so this must remain a plain data structure.
+     */
+    struct BuildStatistics {
+        /// Leaves are counted by their number of triangles, the last bucket holds all larger ones
+        static const uint32_t LeafSizeBuckets = 17;
+        /// Leaves are counted by their depth (the root has a depth of 1)
+        static const uint32_t DepthBuckets = 65;
+
+        uint32_t interiorCount = 0;
+        uint32_t leafCount = 0;
+        uint64_t referenceCount = 0; ///< Triangle references stored in the leaves
+        uint32_t maxDepth = 0;
+        float sahCost = 0.0f;        ///< Expected cost of a ray query (summed over the shapes)
+        uint32_t leafSizes[LeafSizeBuckets] = { };
+        uint32_t leafDepths[DepthBuckets] = { };
+
+        /// Record an interior node with the given (area-weighted) cost
+        void addInterior(float cost) {
+            interiorCount++;
+            sahCost += cost;
+        }
+
+        /// Record a leaf with the given depth, triangle count and (area-weighted) cost
+        void addLeaf(uint32_t depth, uint32_t count, float cost) {
+            leafCount++;
+            referenceCount += count;
+            maxDepth = std::max(maxDepth, depth);
+            sahCost += cost;
+            leafSizes[std::min(count, LeafSizeBuckets - 1)]++;
+            leafDepths[std::min(depth, DepthBuckets - 1)]++;
+        }
+
+        void merge(const BuildStatistics &stats);
+    };
+
+    /**
+     * \brief Print a summary of the finished build
+     *
+     * \param stats
+     *    Statistics of all shapes
+     * \param cachedCount
+     *    Number of shapes that were loaded from the cache
+     * \param nodeMemory
+     *    Size of the nodes of the bottom-level structures in bytes
+     * \param leafMemory
+     *    Size of the triangle data referenced by the leaves in bytes
+     * \param time
+     *    Build time in milliseconds
+     */
+    void printBuildReport(const BuildStatistics &stats, uint32_t cachedCount,
+                          size_t nodeMemory, size_t leafMemory, double time) const;
+
+    /// Node of the top-level hierarchy
+    struct TopLevelNode {
+        /// Bounding box of all meshes below this node
+        BoundingBox3f bbox;
+        /// Leaf: index of the mesh; interior: index of the second child
+        uint32_t offset;
+        /// Interior: split axis; leaf: \c LeafMarker
+        uint32_t axis;
+
+        bool isLeaf() const { return axis == LeafMarker; }
+    };
+
+    /// Marks the leaves of the top-level hierarchy
+    static const uint32_t LeafMarker = 3;
+    /// Maximum depth of the top-level hierarchy (bounds the size of the traversal stack)
+    static const uint32_t TopLevelMaxDepth = 64;
+
+    /// Recursively build the top-level subtree over 'order[start, end)'
+    void buildTopLevel(std::vector<uint32_t> &order, uint32_t start, uint32_t end);
 
-private:
-    Mesh         *m_mesh = nullptr; ///< Mesh (only a single one for now)
-    BoundingBox3f m_bbox;           ///< Bounding box of the entire scene
+protected:
+    std::vector<Mesh *>           m_meshes;      ///< Meshes in the order in which they were added
+    std::vector<const Instance *> m_instances;   ///< Instance of each mesh (or \c nullptr)
+    std::vector<uint32_t>         m_shapeIndex;  ///< Index of the shape of each mesh
+    std::vector<const Mesh *>     m_shapes;      ///< Meshes with their own bottom-level structure
+    std::vector<TopLevelNode>     m_topLevel;    ///< Top-level hierarchy in depth-first order
+    BoundingBox3f                 m_bbox;        ///< Bounding box of the entire scene
+    bool                          m_watertight;  ///< Use the watertight ray-triangle test?
+    AccelCache                    m_cache;       ///< On-disk cache of the bottom-level structures
+    uint32_t                      m_cachedCount; ///< Shapes that the last build loaded from the cache
 };
 
 NORI_NAMESPACE_END
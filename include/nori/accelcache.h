@@ -0,0 +1,144 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+#include <functional>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief On-disk cache of bottom-level acceleration data structures
+ *
+ * Building the acceleration data structure of a large mesh can take much
+ * longer than loading it. When an acceleration data structure is given a
+ * <tt>cacheDirectory</tt>, the structure built over each shape is written
+ * to a file in that directory and memory-mapped back on the next run.
+ *
+ * Cache files are named after a hash of the vertex positions and indices
+ * of the shape and of a description of the acceleration data structure
+ * (its type and build parameters), so that any change to either one
+ * causes a rebuild. Files that were written by a different version of the
+ * format, or whose payload does not match the size and checksum stored in
+ * their header (e.g. because they are truncated), are ignored.
+ */
+class AccelCache {
+public:
+    /// Sequential reader over the payload of a cache file
+    class Reader {
+    public:
+        Reader(const char *data, size_t size) : m_ptr(data), m_end(data + size) { }
+
+        /// Read a value of a plain data type
+        template <typename T> bool read(T &value) {
+            if ((size_t) (m_end - m_ptr) < sizeof(T))
+                return false;
+            memcpy((void *) &value, m_ptr, sizeof(T));
+            m_ptr += sizeof(T);
+            return true;
+        }
+
+        /// Read an array of a plain data type
+        template <typename T> bool read(std::vector<T> &values) {
+            uint64_t count;
+            if (!read(count) || (uint64_t) (m_end - m_ptr) / sizeof(T) < count)
+                return false;
+            values.resize((size_t) count);
+            memcpy((void *) values.data(), m_ptr, (size_t) count * sizeof(T));
+            m_ptr += (size_t) count * sizeof(T);
+            return true;
+        }
+
+        /// Has the entire payload been read?
+        bool isFinished() const { return m_ptr == m_end; }
+
+    private:
+        const char *m_ptr, *m_end;
+    };
+
+    /// Serializes the payload of a cache file into memory
+    class Writer {
+    public:
+        /// Write a value of a plain data type
+        template <typename T> void write(const T &value) {
+            const char *ptr = (const char *) &value;
+            m_data.insert(m_data.end(), ptr, ptr + sizeof(T));
+        }
+
+        /// Write an array of a plain data type
+        template <typename T> void write(const std::vector<T> &values) {
+            write((uint64_t) values.size());
+            const char *ptr = (const char *) values.data();
+            m_data.insert(m_data.end(), ptr, ptr + values.size() * sizeof(T));
+        }
+
+        /// Return the serialized payload
+        const std::vector<char> &getData() const { return m_data; }
+
+    private:
+        std::vector<char> m_data;
+    };
+
+    /// Create a cache that stores its files in the given directory (an empty string disables it)
+    AccelCache(const std::string &directory = "") : m_directory(directory) { }
+
+    /// Is the cache enabled?
+    bool isEnabled() const { return !m_directory.empty(); }
+
+    /// Return the directory that contains the cache files
+    const std::string &getDirectory() const { return m_directory; }
+
+    /**
+     * \brief Look up the structure built over the given shape
+     *
+     * \param description
+     *     Type and build parameters of the acceleration data structure
+     *
+     * \param readFn
+     *     Deserializes the structure from the payload of the cache file and
+     *     returns \c false if the payload is incomplete
+     *
+     * \return \c true if the structure was found and successfully read
+     */
+    bool load(const Mesh *shape, const std::string &description,
+              const std::function<bool (Reader &)> &readFn) const;
+
+    /**
+     * \brief Store the structure built over the given shape
+     *
+     * Failures (e.g. due to missing permissions) only produce a warning.
+     */
+    void save(const Mesh *shape, const std::string &description,
+              const std::function<void (Writer &)> &writeFn) const;
+
+    /// Compute a 64-bit hash of a block of memory
+    static uint64_t hash(const void *data, size_t size, uint64_t seed = 0);
+
+    /// Version of the file format (increase when the layout of the cached structures changes)
+    static const uint32_t Version = 5;
+
+private:
+    /// Return the cache file name of a shape along with the key stored in its header
+    std::string getFilename(const Mesh *shape, const std::string &description, uint64_t &key) const;
+
+    std::string m_directory;
+};
+
+NORI_NAMESPACE_END
@@ -333,62 +333,52 @@ template <typename _PointType> struct TBoundingBox {
 
     /// Check if a ray intersects a bounding box
     bool rayIntersect(const Ray3f &ray) const {
-        float nearT = -std::numeric_limits<float>::infinity();
-        float farT = std::numeric_limits<float>::infinity();
-
-        for (int i=0; i<3; i++) {
-            float origin = ray.o[i];
-            float minVal = min[i], maxVal = max[i];
-
-            if (ray.d[i] == 0) {
-                if (origin < minVal || origin > maxVal)
-                    return false;
-            } else {
-                float t1 = (minVal - origin) * ray.dRcp[i];
-                float t2 = (maxVal - origin) * ray.dRcp[i];
-
-                if (t1 > t2)
-                    std::swap(t1, t2);
-
-                nearT = std::max(t1, nearT);
-                farT = std::min(t2, farT);
-
-                if (!(nearT <= farT))
-                    return false;
-            }
-        }
-
-        return ray.mint <= farT && nearT <= ray.maxt;
+        return rayIntersect(SlabRay(ray), ray.mint, ray.maxt);
     }
 
     /// Return the overlapping region of the bounding box and an unbounded ray
     bool rayIntersect(const Ray3f &ray, float &nearT, float &farT) const {
+        slabDistances(SlabRay(ray), nearT, farT);
+        return nearT <= farT;
+    }
+
+    /**
+     * \brief Check if the segment <tt>[mint, maxt]</tt> of a ray intersects
+     * the bounding box
+     *
+     * Branchless slab test for rays that are tested against many boxes
+     * (see \ref SlabRay).
+     */
+    bool rayIntersect(const SlabRay &ray, float mint, float maxt) const {
+        float nearT, farT;
+        slabDistances(ray, nearT, farT);
+        return std::max(nearT, mint) <= std::min(farT, maxt);
+    }
+
+    /**
+     * \brief Compute the distances at which a ray enters and leaves the
+     * slabs of all three axes
+     *
+     * The ray misses the box if <tt>nearT > farT</tt>.
+     */
+    void slabDistances(const SlabRay &ray, float &nearT, float &farT) const {
         nearT = -std::numeric_limits<float>::infinity();
         farT = std::numeric_limits<float>::infinity();
 
         for (int i=0; i<3; i++) {
-            float origin = ray.o[i];
-            float minVal = min[i], maxVal = max[i];
-
-            if (ray.d[i] == 0) {
-                if (origin < minVal || origin > maxVal)
-                    return false;
-            } else {
-                float t1 = (minVal - origin) * ray.dRcp[i];
-                float t2 = (maxVal - origin) * ray.dRcp[i];
-
-                if (t1 > t2)
-                    std::swap(t1, t2);
-
-                nearT = std::max(t1, nearT);
-                farT = std::min(t2, farT);
-
-                if (!(nearT <= farT))
-                    return false;
-            }
+            float t1 = ((ray.sign[i] ? max[i] : min[i]) - ray.o[i]) * ray.dRcp[i];
+            float t2 = ((ray.sign[i] ? min[i] : max[i]) - ray.o[i]) * ray.dRcp[i];
+
+            /* std::max(a, b) and std::min(a, b) return 'a' when 'b' is NaN,
+               which discards the distances to planes that contain the
+               origin of a parallel ray */
+            nearT = std::max(nearT, t1);
+            farT = std::min(farT, t2);
         }
 
-        return true;
+        /* Conservatively account for rounding errors (a few ulps), so
+           that rays through the boundary (e.g. a vertex) are never missed */
+        farT *= 1.0f + 6.0f * std::numeric_limits<float>::epsilon();
     }
 
     PointType min; ///< Component-wise minimum 
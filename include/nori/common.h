@@ -46,6 +46,12 @@
 #define PLATFORM_WINDOWS
 #endif
 
+/* SSE intrinsics are used by the ray tracing kernels where available
+   (they are always supported on x86-64) */
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define NORI_SSE
+#endif
+
 /* "Ray epsilon": relative error threshold for ray intersection computations */
 #define Epsilon 1e-4f
 
@@ -131,6 +137,7 @@ class NoriObject;
 class NoriObjectFactory;
 class NoriScreen;
 class PhaseFunction;
+struct PreliminaryIntersection;
 class ReconstructionFilter;
 class Sampler;
 class Scene;
@@ -0,0 +1,70 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+#include <nori/transform.h>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Instance of a shared triangle mesh
+ *
+ * An instance places the triangles of another mesh into the scene using its
+ * own \c toWorld transformation, e.g.
+ * <tt>&lt;mesh type="instance"&gt;&lt;string name="filename" value="chair.obj"/&gt;..</tt>.
+ * The file is loaded with the mesh plugin that matches its extension
+ * (\c obj, \c ply, or \c nmesh for the \c binary plugin). All instances
+ * that refer to the same file share a single copy of its vertex data, and
+ * the acceleration data structure builds only one bottom-level structure
+ * for it; rays are intersected by transforming them into the object space
+ * of the shared mesh.
+ *
+ * Each instance has its own BSDF. Area emitters are not supported.
+ */
+class Instance : public Mesh {
+public:
+    Instance(const PropertyList &propList);
+
+    /// Return the shared mesh referenced by this instance
+    const Mesh *getInstancedMesh() const { return m_shape.get(); }
+
+    /// Return the transformation from the object space of the shared mesh to world space
+    const Transform &getToWorld() const { return m_toWorld; }
+
+    /// Return the transformation from world space to the object space of the shared mesh
+    const Transform &getToObject() const { return m_toObject; }
+
+    /// Recompute the bounding box from that of the shared mesh
+    void updateBoundingBox();
+
+    /// Register a child object (e.g. a BSDF) with the instance
+    void addChild(NoriObject *child);
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+
+protected:
+    std::shared_ptr<Mesh> m_shape;    ///< Shared mesh (in object space)
+    Transform             m_toWorld;  ///< Object-to-world transformation
+    Transform             m_toObject; ///< World-to-object transformation
+};
+
+NORI_NAMESPACE_END
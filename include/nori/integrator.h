@@ -53,6 +53,24 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a camera ray whose closest
+     * intersection is already known
+     *
+     * If \ref usesRayStreams() returns \c true, the renderer traces the
+     * camera rays of each image block together using a ray stream query
+     * and calls this function instead of \ref Li(). The \c mesh field of
+     * \c pi is \c nullptr if the ray does not hit anything. The default
+     * implementation ignores the intersection.
+     */
+    virtual Color3f LiPrimary(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                              const PreliminaryIntersection & /* pi */) const {
+        return Li(scene, sampler, ray);
+    }
+
+    /// Should the renderer trace the camera rays in streams and call \ref LiPrimary()?
+    virtual bool usesRayStreams() const { return false; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
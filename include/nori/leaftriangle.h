@@ -0,0 +1,144 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+#include <Eigen/Geometry>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Triangle whose vertex positions are stored directly in a leaf
+ *
+ * Leaves that reference triangles by index have to look up the vertex
+ * indices in the mesh and then gather the three vertices, i.e. two
+ * dependent memory accesses per vertex. Storing copies of the vertices
+ * avoids the indirection at the cost of 40 instead of 4 bytes per
+ * triangle reference. The tests give exactly the same results as
+ * \ref Mesh::rayIntersect() and \ref Mesh::rayIntersectWatertight().
+ */
+struct LeafTriangle {
+    Point3f p0, p1, p2;  ///< Vertex positions
+    uint32_t index;      ///< Triangle index in the mesh
+
+    /// Create an uninitialized record
+    LeafTriangle() { }
+
+    /// Copy the vertices of the triangle \c f of the given mesh
+    LeafTriangle(const Mesh *mesh, uint32_t f) : index(f) {
+        const MatrixXf &V = mesh->getVertexPositions();
+        const MatrixXu &F = mesh->getIndices();
+        p0 = V.col(F(0, f));
+        p1 = V.col(F(1, f));
+        p2 = V.col(F(2, f));
+    }
+
+    /// Moeller-Trumbore intersection test (see \ref Mesh::rayIntersect())
+    bool rayIntersect(const Ray3f &ray, float &u, float &v, float &t) const {
+        Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
+        Vector3f pvec = ray.d.cross(edge2);
+        float det = edge1.dot(pvec);
+        if (det > -1e-8f && det < 1e-8f)
+            return false;
+        float invDet = 1.0f / det;
+
+        Vector3f tvec = ray.o - p0;
+        u = tvec.dot(pvec) * invDet;
+        if (u < 0.0f || u > 1.0f)
+            return false;
+
+        Vector3f qvec = tvec.cross(edge1);
+        v = ray.d.dot(qvec) * invDet;
+        if (v < 0.0f || u + v > 1.0f)
+            return false;
+
+        t = edge2.dot(qvec) * invDet;
+        return t >= ray.mint && t <= ray.maxt;
+    }
+
+    /// Watertight intersection test (see \ref WatertightRay)
+    bool rayIntersectWatertight(const Ray3f &ray, const WatertightRay &wray,
+                                float &u, float &v, float &t) const {
+        return wray.intersect(ray, p0, p1, p2, u, v, t);
+    }
+};
+
+/**
+ * \brief Triangle stored as the affine map from world space into its
+ * barycentric coordinate system
+ *
+ * The map takes \c p0, \c p1 and \c p2 to the origin, the X axis and the
+ * Y axis of the unit triangle, and the triangle normal to the Z axis
+ * (Woop, "A Ray Tracing Hardware Architecture for Dynamic Scenes", 2004).
+ * Transforming the ray reduces the intersection test to finding where it
+ * crosses the plane <tt>z = 0</tt>, and the transformed X and Y
+ * coordinates of that point are the barycentric coordinates. The test
+ * needs fewer operations than Moeller-Trumbore and no vertex data at
+ * all, but is not watertight. Records take 52 bytes.
+ */
+struct AffineTriangle {
+    float m[3][4];   ///< Rows of the map (the last column holds the translation)
+    uint32_t index;  ///< Triangle index in the mesh
+
+    /// Create an uninitialized record
+    AffineTriangle() { }
+
+    /// Precompute the map of the triangle \c f of the given mesh
+    AffineTriangle(const Mesh *mesh, uint32_t f) : index(f) {
+        const MatrixXf &V = mesh->getVertexPositions();
+        const MatrixXu &F = mesh->getIndices();
+        Point3f p0 = V.col(F(0, f));
+        Vector3f e1 = Point3f(V.col(F(1, f))) - p0;
+        Vector3f e2 = Point3f(V.col(F(2, f))) - p0;
+        Vector3f n = e1.cross(e2);
+
+        /* The rows of the inverse of the matrix with the columns (e1, e2, n).
+           Degenerate triangles get NaN rows, which are never hit */
+        float invLength = 1.0f / n.squaredNorm();
+        Vector3f rows[3] = { e2.cross(n) * invLength, n.cross(e1) * invLength, n * invLength };
+        for (int i = 0; i < 3; ++i) {
+            for (int k = 0; k < 3; ++k)
+                m[i][k] = rows[i][k];
+            m[i][3] = -rows[i].dot(p0);
+        }
+    }
+
+    /// Intersection test (the barycentric coordinates follow the convention of \ref Mesh::rayIntersect())
+    bool rayIntersect(const Ray3f &ray, float &u, float &v, float &t) const {
+        /* Distance to the plane of the triangle */
+        float oz = m[2][0] * ray.o.x() + m[2][1] * ray.o.y() + m[2][2] * ray.o.z() + m[2][3];
+        float dz = m[2][0] * ray.d.x() + m[2][1] * ray.d.y() + m[2][2] * ray.d.z();
+        t = -oz / dz;
+        if (!(t >= ray.mint && t <= ray.maxt) || dz == 0.0f)
+            return false;
+
+        float ox = m[0][0] * ray.o.x() + m[0][1] * ray.o.y() + m[0][2] * ray.o.z() + m[0][3];
+        float dx = m[0][0] * ray.d.x() + m[0][1] * ray.d.y() + m[0][2] * ray.d.z();
+        u = ox + t * dx;
+        if (!(u >= 0.0f && u <= 1.0f))
+            return false;
+
+        float oy = m[1][0] * ray.o.x() + m[1][1] * ray.o.y() + m[1][2] * ray.o.z() + m[1][3];
+        float dy = m[1][0] * ray.d.x() + m[1][1] * ray.d.y() + m[1][2] * ray.d.z();
+        v = oy + t * dy;
+        return v >= 0.0f && u + v <= 1.0f;
+    }
+};
+
+NORI_NAMESPACE_END
@@ -63,6 +63,78 @@ struct Intersection {
     std::string toString() const;
 };
 
+/**
+ * \brief Compact record of a ray-triangle intersection
+ *
+ * This is what the traversal of the acceleration data structure produces:
+ * just enough information to identify the intersected triangle and the
+ * position on it. The remaining fields of \ref Intersection (position,
+ * texture coordinates, frames) are only computed on demand, see
+ * \ref Scene::computeIntersection(). This saves the shading setup for
+ * rays whose intersection is never looked at in detail.
+ */
+struct PreliminaryIntersection {
+    /// Unoccluded distance along the ray
+    float t;
+    /// Barycentric coordinates of the second and third vertex
+    Point2f uv;
+    /// Index of the intersected triangle (in the instanced mesh, if any)
+    uint32_t f;
+    /// Pointer to the intersected mesh (or instance)
+    const Mesh *mesh;
+
+    /// Create an invalid intersection record
+    PreliminaryIntersection() : mesh(nullptr) { }
+};
+
+/**
+ * \brief Watertight ray-triangle intersection test
+ *
+ * Implements the algorithm by Woop, Benthin and Wald ("Watertight
+ * Ray/Triangle Intersection", JCGT 2013). The ray direction is mapped onto
+ * the Z axis by a permutation of the coordinate axes followed by a shear,
+ * after which the test reduces to evaluating 2D edge functions. Unlike the
+ * Moeller-Trumbore test, these are evaluated consistently for triangles
+ * sharing an edge, so rays cannot slip through shared edges or vertices.
+ *
+ * The permutation and shear only depend on the ray direction and are
+ * computed once per ray.
+ */
+struct WatertightRay {
+    int kx, ky, kz;    ///< Permutation of the axes (\c kz is the dominant direction)
+    float Sx, Sy, Sz;  ///< Shear coefficients
+
+    /// Create an uninitialized record
+    WatertightRay() { }
+
+    /// Precompute the permutation and shear for the given ray
+    WatertightRay(const Ray3f &ray) {
+        Vector3f absD = ray.d.cwiseAbs();
+        kz = absD.x() > absD.y() ? (absD.x() > absD.z() ? 0 : 2)
+                                 : (absD.y() > absD.z() ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+
+        /* Preserve the winding direction of the triangles */
+        if (ray.d[kz] < 0)
+            std::swap(kx, ky);
+
+        Sx = ray.d[kx] / ray.d[kz];
+        Sy = ray.d[ky] / ray.d[kz];
+        Sz = 1.0f / ray.d[kz];
+    }
+
+    /**
+     * \brief Intersect the ray against the triangle <tt>(p0, p1, p2)</tt>
+     *
+     * On success, \c u and \c v hold the barycentric coordinates of \c p1
+     * and \c p2 (as for \ref Mesh::rayIntersect()), and \c t holds the
+     * distance, which lies within <tt>[ray.mint, ray.maxt]</tt>.
+     */
+    bool intersect(const Ray3f &ray, const Point3f &p0, const Point3f &p1,
+                   const Point3f &p2, float &u, float &v, float &t) const;
+};
+
 /**
  * \brief Triangle mesh
  *
@@ -124,6 +196,23 @@ public:
      */
     bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
 
+    /**
+     * \brief Watertight ray-triangle intersection test
+     *
+     * Same as \ref rayIntersect(), but using the watertight algorithm
+     * described in \ref WatertightRay, whose per-ray data is passed in \c wray.
+     */
+    bool rayIntersectWatertight(uint32_t index, const Ray3f &ray, const WatertightRay &wray,
+                                float &u, float &v, float &t) const;
+
+    /**
+     * \brief Return the shared mesh whose triangles are referenced by this
+     * mesh, or \c nullptr if the mesh stores its own triangles
+     *
+     * See \ref Instance.
+     */
+    virtual const Mesh *getInstancedMesh() const { return nullptr; }
+
     /// Return a pointer to the vertex positions
     const MatrixXf &getVertexPositions() const { return m_V; }
 
@@ -136,6 +225,28 @@ public:
     /// Return a pointer to the triangle vertex index list
     const MatrixXu &getIndices() const { return m_F; }
 
+    /**
+     * \brief Replace the vertex positions, e.g. by those of the next frame
+     * of an animation
+     *
+     * The number of vertices and the triangles must remain unchanged. When
+     * \c N is nonempty, it replaces the vertex normals. The acceleration
+     * data structure must be updated afterwards (see \ref Accel::refit()).
+     */
+    void setVertexPositions(const MatrixXf &V, const MatrixXf &N = MatrixXf());
+
+    /// Recompute the bounding box of the mesh (after its vertices have changed)
+    virtual void updateBoundingBox();
+
+    /**
+     * \brief Write the mesh to a file in Nori's binary mesh format
+     *
+     * Such files are loaded without any parsing by the \c binary mesh
+     * plugin (see src/binarymesh.cpp). Use <tt>nori --convert</tt> to
+     * convert OBJ files.
+     */
+    void saveBinary(const std::string &filename) const;
+
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
 
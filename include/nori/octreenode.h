@@ -1,97 +1,60 @@
-#pragma once
-
-#include<nori/mesh.h>
-
-
-
-NORI_NAMESPACE_BEGIN
-
-class OctreeBaseNode
-{
-   public:
-   OctreeBaseNode()
-   {
-       for(size_t i = 0; i < 8; ++i)
-       {
-           this->children[i] = nullptr;
-       }
-   } 
-   virtual ~OctreeBaseNode(){};   
-   OctreeBaseNode* children[8];
-   OctreeBaseNode* parent = nullptr;
-   BoundingBox3f m_bbox;
-   std::vector<int> m_triangle_idx;
-   int child_id = 0;
-   int depth = 0;
-   bool visited = false;
-};
-
-//OctreeBaseNode::~OctreeBaseNode()
-//{
-//    for(size_t i = 0; i < 8; ++i)
-//    {
-//        if(this->children[i])
-//        {
-//            delete this->children[i];
-//        }
-//    } 
-//
-//}
-
-class OctreeNode : public OctreeBaseNode
-{
-    public:
-    
-    OctreeNode(const BoundingBox3f& bbox, std::vector<int>& triangle_idx)
-    {
-        m_bbox = bbox;
-        m_triangle_idx = triangle_idx;
-        this->init_child();
-    }
-    void init_child()
-    {
-        for(size_t i = 0; i < 8; ++i)
-        {
-            this->children[i] = nullptr;
-        }
-    }
-
-    ~OctreeNode()
-    {
-        for(size_t i = 0; i < 8; ++i)
-        {
-            if(this->children[i])
-            {
-                delete this->children[i];
-            }
-        } 
-        //fprintf(stdout, "OctreeNode deleted\n");
-    }
-
-};
-
-
-class OctreeLeaf : public  OctreeBaseNode
-{
-    public:
-    OctreeLeaf(const BoundingBox3f& bbox, std::vector<int>& triangle_idx)
-    {
-        m_bbox = bbox;
-        m_triangle_idx = triangle_idx;
-    }
-    ~OctreeLeaf()
-    {
-        //fprintf(stdout, "OctreeLeaf deleted\n");
-        for(size_t i = 0; i < 8; ++i)
-        {
-            if(this->children[i])
-            {
-                fprintf(stdout, "WTF\n");
-            }
-        }
-    }
-
-    //std::vector<int> triangle_idx;
-};
-
-NORI_NAMESPACE_END
+#pragma once
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Node of the linear octree layout (8 bytes)
+ *
+ * All nodes of the octree are stored in a single contiguous array. The
+ * non-empty children of an interior node are stored next to each other in
+ * octant order, starting at \c offset; \c childMask records which of the
+ * eight octants are present. Leaves reference the range
+ * <tt>[offset, offset + count)</tt> of the shared triangle buffer of the octree.
+ *
+ * Nodes don't store their bounding box: it follows from the box of the
+ * parent and the octant of the child.
+ */
+struct OctreeNode {
+    /// Interior: index of the first child; leaf: index of its first triangle in the triangle buffer
+    uint32_t offset;
+    /// Bit mask of the non-empty children (zero for leaves)
+    uint32_t childMask : 8;
+    /// Leaf: number of triangles
+    uint32_t count : 24;
+
+    /// Create a leaf node referencing the given range of the index buffer
+    static OctreeNode leaf(uint32_t offset, uint32_t count) {
+        OctreeNode node;
+        node.offset = offset;
+        node.childMask = 0;
+        node.count = count;
+        return node;
+    }
+
+    /// Create an interior node with the given children
+    static OctreeNode interior(uint32_t offset, uint32_t childMask) {
+        OctreeNode node;
+        node.offset = offset;
+        node.childMask = childMask;
+        node.count = 0;
+        return node;
+    }
+
+    /// Is this a leaf node?
+    bool isLeaf() const { return childMask == 0; }
+
+    /// Return the index of the child in the given octant (which must be present)
+    uint32_t child(int octant) const {
+        uint32_t mask = childMask & ((1u << octant) - 1);
+        uint32_t rank = 0;
+        while (mask) {
+            mask &= mask - 1;
+            ++rank;
+        }
+        return offset + rank;
+    }
+};
+
+NORI_NAMESPACE_END
@@ -66,6 +66,9 @@ template <typename _PointType, typename _VectorType> struct TRay {
      : o(ray.o), d(ray.d), dRcp(ray.dRcp),
        mint(ray.mint), maxt(ray.maxt) { }
 
+    /// Assignment operator
+    TRay &operator=(const TRay &ray) = default;
+
     /// Copy a ray, but change the covered segment of the copy
     TRay(const TRay &ray, Scalar mint, Scalar maxt) 
      : o(ray.o), d(ray.d), dRcp(ray.dRcp), mint(mint), maxt(maxt) { }
@@ -98,4 +101,30 @@ template <typename _PointType, typename _VectorType> struct TRay {
     }
 };
 
+/**
+ * \brief Ray data that is computed once and then used to test the ray
+ * against many bounding boxes
+ *
+ * See \ref TBoundingBox::rayIntersect(const SlabRay &, float, float) const.
+ * The sign of each direction component selects the plane of each slab
+ * through which the ray enters, so that the slab test needs no comparisons
+ * between the distances to the two planes. Zero direction components have
+ * infinite reciprocals (of the same sign), for which the distance to a
+ * plane containing the origin is NaN. The slab test ignores these
+ * distances, which matches the behavior for rays that start on the boundary
+ * of a slab parallel to it.
+ */
+struct SlabRay {
+    Point3f o;     ///< Ray origin
+    Vector3f dRcp; ///< Componentwise reciprocals of the ray direction
+    int sign[3];   ///< 1 if the direction component is negative (including -0), 0 otherwise
+
+    SlabRay() { }
+
+    SlabRay(const Ray3f &ray) : o(ray.o), dRcp(ray.dRcp) {
+        for (int i=0; i<3; ++i)
+            sign[i] = std::signbit(ray.d[i]) ? 1 : 0;
+    }
+};
+
 NORI_NAMESPACE_END
@@ -19,7 +19,7 @@
 #pragma once
 
 #include <nori/accel.h>
-#include <nori/octreenode.h>
+
 NORI_NAMESPACE_BEGIN
 
 /**
@@ -37,9 +37,12 @@ public:
     /// Release all memory
     virtual ~Scene();
 
-    /// Return a pointer to the scene's kd-tree
+    /// Return a pointer to the scene's acceleration data structure
     const Accel *getAccel() const { return m_accel; }
 
+    /// Return a pointer to the scene's acceleration data structure
+    Accel *getAccel() { return m_accel; }
+
     /// Return a pointer to the scene's integrator
     const Integrator *getIntegrator() const { return m_integrator; }
 
@@ -73,8 +76,48 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its) const {
-        //return m_accel->rayIntersect(ray, its, false);
-        return m_accel->rayIntersect(ray, its, false, m_root);
+        return m_accel->rayIntersect(ray, its);
+    }
+
+    /**
+     * \brief Intersect a ray against all triangles stored in the scene
+     * and only return a compact intersection record
+     *
+     * This skips the computation of the intersection position, texture
+     * coordinates, and frames, which can be done afterwards using
+     * \ref computeIntersection() if the intersection turns out to be
+     * needed in detail.
+     *
+     * \param ray
+     *    A 3-dimensional ray data structure with minimum/maximum
+     *    extent information
+     *
+     * \param pi
+     *    A compact intersection record, which will be filled by the
+     *    intersection query
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, PreliminaryIntersection &pi) const {
+        return m_accel->rayIntersect(ray, pi);
+    }
+
+    /**
+     * \brief Find the closest intersections of a stream of coherent rays
+     * (e.g. the camera rays of an image block)
+     *
+     * The rays are traversed in groups, see
+     * \ref Accel::rayIntersect(uint32_t, const Ray3f *, PreliminaryIntersection *) const.
+     * The \c mesh field of the records of rays that do not hit anything is
+     * set to \c nullptr.
+     */
+    void rayIntersect(uint32_t count, const Ray3f *rays, PreliminaryIntersection *pi) const {
+        m_accel->rayIntersect(count, rays, pi);
+    }
+
+    /// Compute the detailed intersection record for a compact one
+    void computeIntersection(const PreliminaryIntersection &pi, Intersection &its) const {
+        m_accel->computeIntersection(pi, its);
     }
 
     /**
@@ -93,9 +136,24 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        //return m_accel->rayIntersect(ray, its, true);
-        return m_accel->rayIntersect(ray, its, true, m_root);
+        return m_accel->occluded(ray);
+    }
+
+    /**
+     * \brief Determine whether the ray is blocked by any triangle (shadow
+     * ray query)
+     *
+     * Equivalent to \ref rayIntersect(const Ray3f &) const. The query stops
+     * at the first intersection that is found, regardless of its distance.
+     *
+     * \param ray
+     *    A 3-dimensional ray data structure with minimum/maximum
+     *    extent information
+     *
+     * \return \c true if the ray is occluded
+     */
+    bool occluded(const Ray3f &ray) const {
+        return m_accel->occluded(ray);
     }
 
     /// \brief Return an axis-aligned box that bounds the scene
@@ -106,8 +164,8 @@ public:
     /**
      * \brief Inherited from \ref NoriObject::activate()
      *
-     * Initializes the internal data structures (kd-tree,
-     * emitter sampling data structures, etc.)
+     * Initializes the internal data structures (acceleration data
+     * structure, emitter sampling data structures, etc.)
      */
     void activate();
 
@@ -124,7 +182,6 @@ private:
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
-    OctreeBaseNode* m_root = nullptr;
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,206 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Tokenizer for text-based mesh files (OBJ, ASCII PLY)
+ *
+ * Works directly on the memory-mapped file and parses numbers by hand,
+ * without going through iostreams or allocating temporary strings. Lines
+ * may end with \c '\n' or \c "\r\n", and \c '#' starts a comment.
+ */
+class TextParser {
+public:
+    TextParser(const char *begin, const char *end) : m_ptr(begin), m_end(end) { }
+
+    /// Has the entire input been consumed?
+    bool atEnd() const { return m_ptr == m_end; }
+
+    /// Return the current position within the input
+    const char *getPosition() const { return m_ptr; }
+
+    /// Return the number of the current line (starting at 1)
+    uint32_t getLine() const { return m_line; }
+
+    /// Skip spaces and tabs
+    void skipSpaces() {
+        while (m_ptr != m_end && (*m_ptr == ' ' || *m_ptr == '\t'))
+            ++m_ptr;
+    }
+
+    /// Skip all whitespace, including line breaks
+    void skipWhitespace() {
+        for (; m_ptr != m_end && (*m_ptr == ' ' || *m_ptr == '\t' || *m_ptr == '\r' || *m_ptr == '\n'); ++m_ptr) {
+            if (*m_ptr == '\n')
+                ++m_line;
+        }
+    }
+
+    /// Skip the remainder of the current line, including the line break
+    void skipLine() {
+        const char *newline = (const char *) memchr(m_ptr, '\n', (size_t) (m_end - m_ptr));
+        m_ptr = newline ? newline + 1 : m_end;
+        ++m_line;
+    }
+
+    /// Does the current line end here (ignoring comments)?
+    bool atEndOfLine() const {
+        return m_ptr == m_end || *m_ptr == '\n' || *m_ptr == '\r' || *m_ptr == '#';
+    }
+
+    /// Consume the given keyword if it is followed by whitespace
+    bool consumeKeyword(const char *keyword) {
+        size_t length = strlen(keyword);
+        if ((size_t) (m_end - m_ptr) <= length || memcmp(m_ptr, keyword, length) != 0 ||
+            (m_ptr[length] != ' ' && m_ptr[length] != '\t'))
+            return false;
+        m_ptr += length;
+        return true;
+    }
+
+    /// Consume the given character if it comes next
+    bool consume(char c) {
+        if (m_ptr == m_end || *m_ptr != c)
+            return false;
+        ++m_ptr;
+        return true;
+    }
+
+    /// Parse an unsigned decimal integer
+    bool parseUInt(uint32_t &value) {
+        uint64_t result = 0;
+        const char *start = m_ptr;
+        while (m_ptr != m_end && isDigit(*m_ptr)) {
+            result = result * 10 + (uint64_t) (*m_ptr++ - '0');
+            if (result > 0xFFFFFFFFull)
+                return false;
+        }
+        value = (uint32_t) result;
+        return m_ptr != start;
+    }
+
+    /**
+     * \brief Parse a floating point value after skipping leading spaces
+     *
+     * Short decimals are converted exactly using the fast path by Clinger
+     * ("How to Read Floating Point Numbers Accurately", PLDI 1990), which
+     * covers the numbers written by common exporters. Other numbers
+     * (e.g. long mantissas, huge exponents, \c inf or \c nan) are passed
+     * on to \c strtof(), so the result is always identical to it.
+     */
+    bool parseFloat(float &value) {
+        skipSpaces();
+        const char *start = m_ptr, *p = m_ptr;
+        bool negative = false;
+        if (p != m_end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+
+        /* Significant digits (at most 19 fit into 64 bits) and the decimal exponent */
+        uint64_t mantissa = 0;
+        int digits = 0, exponent = 0;
+        bool valid = false;
+        for (; p != m_end && isDigit(*p); ++p) {
+            valid = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+                digits += mantissa != 0;
+            } else {
+                ++exponent;
+            }
+        }
+        if (p != m_end && *p == '.') {
+            for (++p; p != m_end && isDigit(*p); ++p) {
+                valid = true;
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+                    digits += mantissa != 0;
+                    --exponent;
+                }
+            }
+        }
+        if (valid && p != m_end && (*p == 'e' || *p == 'E')) {
+            const char *q = p + 1;
+            bool negativeExponent = false;
+            if (q != m_end && (*q == '-' || *q == '+'))
+                negativeExponent = *q++ == '-';
+            if (q != m_end && isDigit(*q)) {
+                int e = 0;
+                for (; q != m_end && isDigit(*q); ++q)
+                    e = std::min(e * 10 + (*q - '0'), 100000);
+                exponent += negativeExponent ? -e : e;
+                p = q;
+            }
+        }
+
+        if (valid && (p == m_end || !isTokenChar(*p))) {
+            /* The mantissa and the power of ten are exact, so a single rounding step follows */
+            static const double powers[] = {
+                1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+            };
+            if (mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22) {
+                double result = exponent < 0 ? (double) mantissa / powers[-exponent]
+                                             : (double) mantissa * powers[exponent];
+                /* Rounding to float again is only ambiguous when the double
+                   lies exactly halfway between two floats */
+                uint64_t bits;
+                memcpy(&bits, &result, sizeof(double));
+                float f = (float) result;
+                if (mantissa == 0 || ((bits & 0x1FFFFFFFull) != 0x10000000ull &&
+                                      std::abs(f) >= std::numeric_limits<float>::min())) {
+                    value = negative ? -f : f;
+                    m_ptr = p;
+                    return true;
+                }
+            }
+        }
+
+        /* Slow path: let the C library parse a null-terminated copy of the token */
+        char buffer[128];
+        size_t length = 0;
+        for (p = start; p != m_end && isTokenChar(*p) && length < sizeof(buffer) - 1; ++p)
+            buffer[length++] = *p;
+        buffer[length] = '\0';
+        char *endPtr = nullptr;
+        value = strtof(buffer, &endPtr);
+        if (length == 0 || endPtr != buffer + length)
+            return false;
+        m_ptr = p;
+        return true;
+    }
+
+private:
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    /// Can the character be part of a number (i.e. it is not whitespace or a separator)?
+    static bool isTokenChar(char c) {
+        return c != ' ' && c != '\t' && c != '\n' && c != '\r' && c != '/' && c != '#';
+    }
+
+    const char *m_ptr;
+    const char *m_end;
+    uint32_t m_line = 1;
+};
+
+NORI_NAMESPACE_END
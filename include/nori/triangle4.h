@@ -0,0 +1,255 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+
+#if defined(NORI_SSE)
+#include <xmmintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Packet of four triangles in SoA layout for leaf intersection tests
+ *
+ * Stores the vertex positions of four triangles (copied from the mesh), so
+ * that the intersection tests of \ref Mesh::rayIntersect() and
+ * \ref Mesh::rayIntersectWatertight() can be evaluated for all four
+ * triangles at once using SSE instructions. Unused lanes hold NaN
+ * vertices, which are never hit.
+ */
+struct Triangle4 {
+    float v0[3][4];     ///< First vertex of each triangle
+    float v1[3][4];     ///< Second vertex of each triangle
+    float v2[3][4];     ///< Third vertex of each triangle
+    uint32_t index[4];  ///< Triangle index in the mesh (or <tt>(uint32_t) -1</tt>)
+
+    /// Create a packet with four unused lanes
+    Triangle4() {
+        float nan = std::numeric_limits<float>::quiet_NaN();
+        for (int k = 0; k < 3; ++k) {
+            for (int i = 0; i < 4; ++i)
+                v0[k][i] = v1[k][i] = v2[k][i] = nan;
+        }
+        for (int i = 0; i < 4; ++i)
+            index[i] = (uint32_t) -1;
+    }
+
+    /// Store the triangle \c f of the given mesh in the specified lane
+    void set(int lane, const Mesh *mesh, uint32_t f) {
+        const MatrixXf &V = mesh->getVertexPositions();
+        const MatrixXu &F = mesh->getIndices();
+        for (int k = 0; k < 3; ++k) {
+            v0[k][lane] = V(k, F(0, f));
+            v1[k][lane] = V(k, F(1, f));
+            v2[k][lane] = V(k, F(2, f));
+        }
+        index[lane] = f;
+    }
+
+    /// Return the vertices of the triangle in the given lane
+    void getVertices(int lane, Point3f &p0, Point3f &p1, Point3f &p2) const {
+        p0 = Point3f(v0[0][lane], v0[1][lane], v0[2][lane]);
+        p1 = Point3f(v1[0][lane], v1[1][lane], v1[2][lane]);
+        p2 = Point3f(v2[0][lane], v2[1][lane], v2[2][lane]);
+    }
+
+    /**
+     * \brief Intersect a ray against the four triangles using the
+     * Moeller-Trumbore test (see \ref Mesh::rayIntersect())
+     *
+     * \return \c true if at least one triangle is hit within
+     * <tt>[ray.mint, ray.maxt]</tt>. In that case, \c u, \c v, \c t and \c f
+     * refer to the closest such intersection.
+     */
+    bool rayIntersect(const Ray3f &ray, float &u, float &v, float &t, uint32_t &f) const {
+        float us[4], vs[4], ts[4];
+#if defined(NORI_SSE)
+        __m128 dx = _mm_set1_ps(ray.d.x()), dy = _mm_set1_ps(ray.d.y()), dz = _mm_set1_ps(ray.d.z());
+        __m128 p0x = _mm_loadu_ps(v0[0]), p0y = _mm_loadu_ps(v0[1]), p0z = _mm_loadu_ps(v0[2]);
+        __m128 e1x = _mm_sub_ps(_mm_loadu_ps(v1[0]), p0x);
+        __m128 e1y = _mm_sub_ps(_mm_loadu_ps(v1[1]), p0y);
+        __m128 e1z = _mm_sub_ps(_mm_loadu_ps(v1[2]), p0z);
+        __m128 e2x = _mm_sub_ps(_mm_loadu_ps(v2[0]), p0x);
+        __m128 e2y = _mm_sub_ps(_mm_loadu_ps(v2[1]), p0y);
+        __m128 e2z = _mm_sub_ps(_mm_loadu_ps(v2[2]), p0z);
+
+        /* pvec = d x e2 and det = e1 . pvec */
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+
+        /* Reject triangles that are (nearly) parallel to the ray */
+        __m128 eps = _mm_set1_ps(1e-8f);
+        __m128 mask = _mm_or_ps(_mm_cmple_ps(det, _mm_sub_ps(_mm_setzero_ps(), eps)), _mm_cmpge_ps(det, eps));
+        __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+        /* tvec = o - p0 and the U parameter */
+        __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.o.x()), p0x);
+        __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.o.y()), p0y);
+        __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.o.z()), p0z);
+        __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(uu, _mm_setzero_ps()), _mm_cmple_ps(uu, _mm_set1_ps(1.0f))));
+
+        /* qvec = tvec x e1 and the V parameter */
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+        __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(vv, _mm_setzero_ps()),
+                                           _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.0f))));
+
+        /* Distance along the ray */
+        __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+        mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(tt, _mm_set1_ps(ray.mint)),
+                                           _mm_cmple_ps(tt, _mm_set1_ps(ray.maxt))));
+
+        int hits = _mm_movemask_ps(mask);
+        if (hits == 0)
+            return false;
+
+        _mm_storeu_ps(us, uu);
+        _mm_storeu_ps(vs, vv);
+        _mm_storeu_ps(ts, tt);
+#else
+        int hits = 0;
+        for (int i = 0; i < 4; ++i) {
+            Point3f p0, p1, p2;
+            getVertices(i, p0, p1, p2);
+            Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
+            Vector3f pvec = ray.d.cross(edge2);
+            float det = edge1.dot(pvec);
+            if (!(det <= -1e-8f || det >= 1e-8f))
+                continue;
+            float invDet = 1.0f / det;
+            Vector3f tvec = ray.o - p0;
+            us[i] = tvec.dot(pvec) * invDet;
+            if (us[i] < 0.0f || us[i] > 1.0f)
+                continue;
+            Vector3f qvec = tvec.cross(edge1);
+            vs[i] = ray.d.dot(qvec) * invDet;
+            if (vs[i] < 0.0f || us[i] + vs[i] > 1.0f)
+                continue;
+            ts[i] = edge2.dot(qvec) * invDet;
+            if (ts[i] >= ray.mint && ts[i] <= ray.maxt)
+                hits |= 1 << i;
+        }
+        if (hits == 0)
+            return false;
+#endif
+
+        return selectClosest(hits, us, vs, ts, u, v, t, f);
+    }
+
+    /**
+     * \brief Intersect a ray against the four triangles using the
+     * watertight test (see \ref WatertightRay)
+     *
+     * \return \c true if at least one triangle is hit within
+     * <tt>[ray.mint, ray.maxt]</tt>. In that case, \c u, \c v, \c t and \c f
+     * refer to the closest such intersection.
+     */
+    bool rayIntersectWatertight(const Ray3f &ray, const WatertightRay &wray,
+                                float &u, float &v, float &t, uint32_t &f) const {
+        float us[4], vs[4], ts[4];
+        int hits = 0;
+#if defined(NORI_SSE)
+        int kx = wray.kx, ky = wray.ky, kz = wray.kz;
+        __m128 ox = _mm_set1_ps(ray.o[kx]), oy = _mm_set1_ps(ray.o[ky]), oz = _mm_set1_ps(ray.o[kz]);
+        __m128 Sx = _mm_set1_ps(wray.Sx), Sy = _mm_set1_ps(wray.Sy);
+
+        /* Vertices relative to the ray origin, sheared so that the ray points along +Z */
+        __m128 Az = _mm_sub_ps(_mm_loadu_ps(v0[kz]), oz);
+        __m128 Bz = _mm_sub_ps(_mm_loadu_ps(v1[kz]), oz);
+        __m128 Cz = _mm_sub_ps(_mm_loadu_ps(v2[kz]), oz);
+        __m128 Ax = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(v0[kx]), ox), _mm_mul_ps(Sx, Az));
+        __m128 Ay = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(v0[ky]), oy), _mm_mul_ps(Sy, Az));
+        __m128 Bx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(v1[kx]), ox), _mm_mul_ps(Sx, Bz));
+        __m128 By = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(v1[ky]), oy), _mm_mul_ps(Sy, Bz));
+        __m128 Cx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(v2[kx]), ox), _mm_mul_ps(Sx, Cz));
+        __m128 Cy = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(v2[ky]), oy), _mm_mul_ps(Sy, Cz));
+
+        /* Scaled barycentric coordinates (2D edge functions) */
+        __m128 U = _mm_sub_ps(_mm_mul_ps(Cx, By), _mm_mul_ps(Cy, Bx));
+        __m128 V = _mm_sub_ps(_mm_mul_ps(Ax, Cy), _mm_mul_ps(Ay, Cx));
+        __m128 W = _mm_sub_ps(_mm_mul_ps(Bx, Ay), _mm_mul_ps(By, Ax));
+
+        __m128 zero = _mm_setzero_ps();
+        __m128 onEdge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(U, zero), _mm_cmpeq_ps(V, zero)), _mm_cmpeq_ps(W, zero));
+        if (_mm_movemask_ps(onEdge) == 0) {
+            /* The ray hits a triangle iff its edge functions agree in sign */
+            __m128 anyNeg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+            __m128 anyPos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+            __m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+            __m128 mask = _mm_andnot_ps(_mm_and_ps(anyNeg, anyPos), _mm_cmpneq_ps(det, zero));
+
+            /* Hit distance */
+            __m128 T = _mm_mul_ps(_mm_set1_ps(wray.Sz),
+                _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, Az), _mm_mul_ps(V, Bz)), _mm_mul_ps(W, Cz)));
+            __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+            __m128 tt = _mm_mul_ps(T, invDet);
+            mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(tt, _mm_set1_ps(ray.mint)),
+                                               _mm_cmple_ps(tt, _mm_set1_ps(ray.maxt))));
+
+            hits = _mm_movemask_ps(mask);
+            if (hits == 0)
+                return false;
+
+            _mm_storeu_ps(us, _mm_mul_ps(V, invDet));
+            _mm_storeu_ps(vs, _mm_mul_ps(W, invDet));
+            _mm_storeu_ps(ts, tt);
+            return selectClosest(hits, us, vs, ts, u, v, t, f);
+        }
+
+        /* The ray passes exactly through an edge of some triangle: use
+           the scalar test, which falls back to double precision */
+#endif
+        for (int i = 0; i < 4; ++i) {
+            Point3f p0, p1, p2;
+            getVertices(i, p0, p1, p2);
+            if (wray.intersect(ray, p0, p1, p2, us[i], vs[i], ts[i]))
+                hits |= 1 << i;
+        }
+        if (hits == 0)
+            return false;
+
+        return selectClosest(hits, us, vs, ts, u, v, t, f);
+    }
+
+private:
+    /// Return the closest of the intersections in the lanes set in \c hits
+    bool selectClosest(int hits, const float *us, const float *vs, const float *ts,
+                       float &u, float &v, float &t, uint32_t &f) const {
+        int best = -1;
+        for (int i = 0; i < 4; ++i) {
+            if ((hits & (1 << i)) && (best < 0 || ts[i] < ts[best]))
+                best = i;
+        }
+
+        u = us[best];
+        v = vs[best];
+        t = ts[best];
+        f = index[best];
+        return true;
+    }
+};
+
+NORI_NAMESPACE_END
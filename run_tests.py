@@ -4,6 +4,18 @@ import subprocess
 import sys
 
 TEST_SCENES = [
+    "pa1/tests/accelbench-bunny.xml",
+    "pa1/tests/accelbench-cbox.xml",
+    "pa1/tests/accelbench-instances.xml",
+    "pa1/tests/accelbench-table.xml",
+    "pa1/tests/accelbench-params.xml",
+    "pa1/tests/accelbench-refit.xml",
+    "pa1/tests/accelbench-leaves.xml",
+    "pa1/tests/accelbench-cache.xml",
+    "pa1/tests/watertight-bunny.xml",
+    "pa1/tests/slabtest.xml",
+    "pa1/tests/loadbench.xml",
+    "pa1/tests/loadbench-logo.xml",
     "pa4/tests/test-mesh.xml",
     "pa4/tests/test-mesh-furnace.xml",
     "pa5/tests/chi2test-microfacet.xml",
@@ -48,7 +60,9 @@ def test_warps_and_scenes(scenes, warps):
 
     for t in scenes:
         path = os.path.join("scenes", t)
-        ret = subprocess.call([os.path.join(build_dir, "nori"), path])
+        # The acceleration benchmarks use a build of Nori that counts heap allocations
+        executable = "accelbench" if os.path.basename(t).startswith("accelbench") else "nori"
+        ret = subprocess.call([os.path.join(build_dir, executable), path])
         if ret == 0:
             passed += 1
         else:
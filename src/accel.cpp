@@ -18,283 +18,439 @@
 
 #include <nori/accel.h>
 #include <Eigen/Geometry>
+#include <filesystem/resolver.h>
 
 NORI_NAMESPACE_BEGIN
 
+Accel::Accel(const PropertyList &propList) {
+    /* Use the watertight ray-triangle test? (default: no) */
+    m_watertight = propList.getBoolean("watertight", false);
+
+    /* Directory of the on-disk cache (default: none) */
+    filesystem::path cacheDirectory = propList.getString("cacheDirectory", "");
+    if (!cacheDirectory.empty() && !cacheDirectory.is_absolute() && getFileResolver()->size() > 0)
+        cacheDirectory = (*getFileResolver())[0] / cacheDirectory;
+    m_cache = AccelCache(cacheDirectory.str());
+    m_cachedCount = 0;
+}
+
 void Accel::addMesh(Mesh *mesh) {
-    if (m_mesh)
-        throw NoriException("Accel: only a single mesh is supported!");
-    m_mesh = mesh;
-    m_bbox = m_mesh->getBoundingBox();
+    const Mesh *shape = mesh;
+    const Instance *instance = nullptr;
+    if (mesh->getInstancedMesh()) {
+        instance = static_cast<const Instance *>(mesh);
+        shape = instance->getInstancedMesh();
+    }
+
+    /* Instances of the same mesh share its bottom-level structure */
+    auto it = std::find(m_shapes.begin(), m_shapes.end(), shape);
+    if (it == m_shapes.end())
+        it = m_shapes.insert(m_shapes.end(), shape);
+
+    m_meshes.push_back(mesh);
+    m_instances.push_back(instance);
+    m_shapeIndex.push_back((uint32_t) (it - m_shapes.begin()));
+    m_bbox.expandBy(mesh->getBoundingBox());
 }
 
-void Accel::build() {
-    /* Nothing to do here for now */
+void Accel::refit() {
+    updateBoundingBoxes();
+    build();
 }
-bool Accel::rayIntersect(
-    const Ray3f& ray_,
-    Intersection& its,
-    bool shadowRay,
-    OctreeBaseNode* root
-) const
-{
-    bool foundIntersection = false;
-    uint32_t f = (uint32_t) -1;
-    Ray3f ray(ray_);
-
-    OctreeBaseNode* node = root;
-    std::stack<OctreeBaseNode*> dfs_stack;
-    std::vector<std::pair<OctreeBaseNode*, float>> leaf_nodes;
-    dfs_stack.push(node);
-
-//    float curT = std::numeric_limits<float>::max();
-
-    while(!dfs_stack.empty())
-    {
-        auto top = dfs_stack.top();
-        dfs_stack.pop();
-        if(checkLeaf(top) && top->m_triangle_idx.size() > 0)
-        {
-            float tt1, tt2;
-            top->m_bbox.rayIntersect(ray, tt1, tt2);
-            leaf_nodes.push_back(std::make_pair(top, tt1));
-        }
-        for(size_t i = 0; i < 8; ++i)
-        {
-            if(top->children[i])
-            {
-                if(top->children[i]->m_bbox.rayIntersect(ray))
-                {
-                    dfs_stack.push(top->children[i]);
+
+void Accel::updateBoundingBoxes() {
+    m_bbox.reset();
+    for (size_t i = 0; i < m_meshes.size(); ++i) {
+        /* Instances refer to the shared mesh, which might have changed */
+        if (m_instances[i])
+            m_meshes[i]->updateBoundingBox();
+        m_bbox.expandBy(m_meshes[i]->getBoundingBox());
+    }
+}
+
+void Accel::buildTopLevel() {
+    m_topLevel.clear();
+    if (m_meshes.empty())
+        return;
+
+    std::vector<uint32_t> order(m_meshes.size());
+    for (uint32_t i = 0; i < (uint32_t) order.size(); ++i)
+        order[i] = i;
+
+    /* A binary tree with one mesh per leaf has 2N - 1 nodes */
+    m_topLevel.reserve(2 * m_meshes.size() - 1);
+    buildTopLevel(order, 0, (uint32_t) order.size());
+}
+
+void Accel::buildTopLevel(std::vector<uint32_t> &order, uint32_t start, uint32_t end) {
+    uint32_t nodeIdx = (uint32_t) m_topLevel.size();
+    m_topLevel.emplace_back();
+
+    BoundingBox3f bbox, centroidBBox;
+    for (uint32_t i = start; i < end; ++i) {
+        const BoundingBox3f &meshBBox = m_meshes[order[i]]->getBoundingBox();
+        bbox.expandBy(meshBBox);
+        centroidBBox.expandBy(meshBBox.getCenter());
+    }
+    m_topLevel[nodeIdx].bbox = bbox;
+
+    if (end - start == 1) {
+        m_topLevel[nodeIdx].offset = order[start];
+        m_topLevel[nodeIdx].axis = LeafMarker;
+        return;
+    }
+
+    /* There are usually only a few meshes, so a median split suffices */
+    int axis = centroidBBox.getMajorAxis();
+    uint32_t split = start + (end - start) / 2;
+    std::nth_element(&order[start], &order[split], &order[0] + end,
+        [&](uint32_t a, uint32_t b) {
+            return m_meshes[a]->getBoundingBox().getCenter()[axis] <
+                   m_meshes[b]->getBoundingBox().getCenter()[axis];
+        });
+
+    buildTopLevel(order, start, split);
+    m_topLevel[nodeIdx].offset = (uint32_t) m_topLevel.size();
+    m_topLevel[nodeIdx].axis = (uint32_t) axis;
+    buildTopLevel(order, split, end);
+}
+
+void Accel::BuildStatistics::merge(const BuildStatistics &stats) {
+    interiorCount += stats.interiorCount;
+    leafCount += stats.leafCount;
+    referenceCount += stats.referenceCount;
+    maxDepth = std::max(maxDepth, stats.maxDepth);
+    sahCost += stats.sahCost;
+    for (uint32_t i = 0; i < LeafSizeBuckets; ++i)
+        leafSizes[i] += stats.leafSizes[i];
+    for (uint32_t i = 0; i < DepthBuckets; ++i)
+        leafDepths[i] += stats.leafDepths[i];
+}
+
+void Accel::printBuildReport(const BuildStatistics &stats, uint32_t cachedCount,
+                             size_t nodeMemory, size_t leafMemory, double time) const {
+    size_t triCount = 0;
+    for (const Mesh *shape : m_shapes)
+        triCount += shape->getTriangleCount();
+    float leafCount = (float) std::max(stats.leafCount, 1u);
+    size_t topLevelMemory = m_topLevel.size() * sizeof(TopLevelNode);
+
+    cout << "done. (took " << timeString(time) << ")" << endl;
+
+    cout << "  Meshes: " << m_meshes.size() << " (" << m_shapes.size() << " shapes";
+    if (m_cache.isEnabled())
+        cout << ", " << cachedCount << " cached";
+    cout << ", " << triCount << " triangles)" << endl;
+
+    cout << "  Nodes: " << stats.interiorCount << " interior, " << stats.leafCount
+         << " leaves, " << m_topLevel.size() << " top-level, "
+         << tfm::format("%.2f", stats.referenceCount / (float) std::max(triCount, size_t(1)))
+         << " references/triangle" << endl;
+
+    /* Only the nonempty buckets of the histograms are listed */
+    cout << tfm::format("  Leaf occupancy (mean %.2f):", stats.referenceCount / leafCount);
+    for (uint32_t i = 0; i < BuildStatistics::LeafSizeBuckets; ++i) {
+        if (stats.leafSizes[i] == 0)
+            continue;
+        bool last = i + 1 == BuildStatistics::LeafSizeBuckets;
+        cout << tfm::format(" %i%s: %.1f%%", i, last ? "+" : "",
+                            100 * stats.leafSizes[i] / leafCount);
+    }
+    cout << endl;
+
+    uint64_t depthSum = 0;
+    for (uint32_t i = 0; i < BuildStatistics::DepthBuckets; ++i)
+        depthSum += (uint64_t) i * stats.leafDepths[i];
+    cout << tfm::format("  Leaf depth (mean %.2f, max. %i):", depthSum / leafCount, stats.maxDepth);
+    for (uint32_t i = 0; i < BuildStatistics::DepthBuckets; ++i) {
+        if (stats.leafDepths[i] > 0)
+            cout << tfm::format(" %i: %.1f%%", i, 100 * stats.leafDepths[i] / leafCount);
+    }
+    cout << endl;
+
+    cout << tfm::format("  Estimated SAH cost: %.2f", stats.sahCost) << endl;
+    cout << "  Memory: " << memString(nodeMemory + leafMemory + topLevelMemory)
+         << " (nodes " << memString(nodeMemory) << ", leaves " << memString(leafMemory)
+         << ", top level " << memString(topLevelMemory) << ")" << endl;
+}
+
+bool Accel::rayIntersect(const Ray3f &ray_, PreliminaryIntersection &pi) const {
+    if (m_topLevel.empty())
+        return false;
+
+    bool foundIntersection = false;   // Was an intersection found so far?
+    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+
+    /* Same traversal order as in the BVH: near child first, the other
+       one is pushed onto a fixed-size stack */
+    bool dirIsNeg[3] = { ray.d.x() < 0, ray.d.y() < 0, ray.d.z() < 0 };
+    SlabRay sray(ray);
+    uint32_t stack[TopLevelMaxDepth];
+    uint32_t stackSize = 0;
+    uint32_t nodeIdx = 0;
+
+    while (true) {
+        const TopLevelNode &node = m_topLevel[nodeIdx];
+
+        if (node.bbox.rayIntersect(sray, ray.mint, ray.maxt)) {
+            if (node.isLeaf()) {
+                uint32_t meshIdx = node.offset, shapeIdx = m_shapeIndex[meshIdx];
+                const Instance *instance = m_instances[meshIdx];
+                bool hit;
+
+                if (instance) {
+                    /* The transformed direction is not normalized, so
+                       distances along the ray are the same in both spaces */
+                    Ray3f localRay = instance->getToObject() * ray;
+                    hit = rayIntersectShape(shapeIdx, localRay, pi);
+                    ray.maxt = localRay.maxt;
+                } else {
+                    hit = rayIntersectShape(shapeIdx, ray, pi);
                 }
+
+                if (hit) {
+                    pi.mesh = m_meshes[meshIdx];
+                    foundIntersection = true;
+                }
+            } else {
+                if (dirIsNeg[node.axis]) {
+                    stack[stackSize++] = nodeIdx + 1;
+                    nodeIdx = node.offset;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    nodeIdx = nodeIdx + 1;
+                }
+                continue;
             }
         }
+
+        if (stackSize == 0)
+            break;
+        nodeIdx = stack[--stackSize];
     }
-    //while(!dfs_stack.empty())
-    //{
-    //    auto top = dfs_stack.top();
-    //    dfs_stack.pop(); 
-    //    if(top->m_bbox.rayIntersect(ray))
-    //    {
-    //        if(checkLeaf(top) && top->m_triangle_idx.size() > 0)
-    //        {
-    //            leaf_nodes.push_back(top);
-    //        } 
-    //    }
-
-    //    for(size_t i = 0; i < 8; ++i)
-    //    {
-    //        if(top->children[i])
-    //        {
-    //            dfs_stack.push(top->children[i]);
-    //        }
-    //    }
-    //}
-
-    struct{
-        bool operator()(const std::pair<OctreeBaseNode*, float>& a, const std::pair<OctreeBaseNode*, float>& b) const
-        {
-            return a.second < b.second;
+
+    return foundIntersection;
+}
+
+void Accel::rayIntersect(uint32_t count, const Ray3f *rays_, PreliminaryIntersection *pi_) const {
+    for (uint32_t i = 0; i < count; ++i)
+        pi_[i] = PreliminaryIntersection();
+    if (m_topLevel.empty())
+        return;
+
+    Ray3f rays[RayStreamSize], localRays[RayStreamSize];
+    SlabRay srays[RayStreamSize];
+
+    /* Same traversal as for a single ray, but each node is visited with the
+       mask of the rays that reached its parent, and the rays that miss the
+       node are removed from it. The masks of the far children are pushed
+       onto the stack */
+    struct StackEntry {
+        uint32_t nodeIdx;
+        uint64_t active;
+    };
+    StackEntry stack[TopLevelMaxDepth];
+
+    for (uint32_t start = 0; start < count; start += RayStreamSize) {
+        uint32_t size = std::min(count - start, RayStreamSize);
+        PreliminaryIntersection *pi = pi_ + start;
+        for (uint32_t i = 0; i < size; ++i) {
+            rays[i] = rays_[start + i];
+            srays[i] = SlabRay(rays[i]);
         }
-    }leafSort;
-    bool flag = false;
-    if(!leaf_nodes.empty())
-    {
-        std::sort(leaf_nodes.begin(), leaf_nodes.end(), leafSort);
-            for(size_t i = 0; i < leaf_nodes.size() && !flag; ++i)
-            {
-					//fprintf(stdout, "leaf %d; box t %f;\n", i, leaf_nodes[i].second);
-                for(size_t j = 0; j < leaf_nodes[i].first->m_triangle_idx.size() && !flag; ++j)
-                {
-                    float u, v, t;
-                    if(m_mesh->rayIntersect(leaf_nodes[i].first->m_triangle_idx[j], ray, u, v, t))
-                    {
-                        if(shadowRay) 
-                        {
-                            foundIntersection = true;
-                            return true;
+
+        uint32_t stackSize = 0;
+        uint32_t nodeIdx = 0;
+        uint64_t active = size == RayStreamSize ? ~(uint64_t) 0 : ((uint64_t) 1 << size) - 1;
+
+        while (true) {
+            const TopLevelNode &node = m_topLevel[nodeIdx];
+            for (uint32_t i = 0; i < size; ++i) {
+                if ((active >> i & 1) && !node.bbox.rayIntersect(srays[i], rays[i].mint, rays[i].maxt))
+                    active &= ~((uint64_t) 1 << i);
+            }
+
+            if (active) {
+                if (node.isLeaf()) {
+                    uint32_t meshIdx = node.offset, shapeIdx = m_shapeIndex[meshIdx];
+                    const Instance *instance = m_instances[meshIdx];
+                    uint64_t hits;
+
+                    if (instance) {
+                        for (uint32_t i = 0; i < size; ++i) {
+                            if (active >> i & 1)
+                                localRays[i] = instance->getToObject() * rays[i];
+                        }
+                        hits = rayIntersectShapeStream(shapeIdx, localRays, pi, active);
+                        for (uint32_t i = 0; i < size; ++i) {
+                            if (active >> i & 1)
+                                rays[i].maxt = localRays[i].maxt;
                         }
-                        ray.maxt = its.t = t;
-                        its.uv = Point2f(u, v);
-                        its.mesh = m_mesh;
-                        f = leaf_nodes[i].first->m_triangle_idx[j];
-                        foundIntersection = true;
-						flag = true;
-                        //fprintf(stdout, "leaf %d; tri %d; tri id %d; t %f, box t %f;\n", i, j, f, t, leaf_nodes[i].second); 
+                    } else {
+                        hits = rayIntersectShapeStream(shapeIdx, rays, pi, active);
                     }
+
+                    for (uint32_t i = 0; i < size; ++i) {
+                        if (hits >> i & 1)
+                            pi[i].mesh = m_meshes[meshIdx];
+                    }
+                } else {
+                    /* The rays are assumed to be coherent, so the direction
+                       of the first active one decides which child is
+                       visited first */
+                    uint32_t first = 0;
+                    while (!(active >> first & 1))
+                        ++first;
+                    bool dirIsNeg = rays[first].d[node.axis] < 0;
+                    stack[stackSize++] = StackEntry { dirIsNeg ? nodeIdx + 1 : node.offset, active };
+                    nodeIdx = dirIsNeg ? node.offset : nodeIdx + 1;
+                    continue;
                 }
             }
-            //fprintf(stdout, "\t\n");
-        
-   }
-    //if(!leaf_nodes.empty())
-    //{
-    //    std::sort(leaf_nodes.begin(), leaf_nodes.end(), leafSort); 
-    //    for(size_t j = 0; j < leaf_nodes[0].first->m_triangle_idx.size(); ++j)
-    //    {
-    //        float u, v, t;
-    //        if(m_mesh->rayIntersect(leaf_nodes[0].first->m_triangle_idx[j], ray, u, v, t))
-    //        {
-    //            if(shadowRay) return true;
-    //            ray.maxt = its.t = t;
-    //            its.uv = Point2f(u, v);
-    //            its.mesh = m_mesh;
-    //            f = leaf_nodes[0].first->m_triangle_idx[j];
-    //            foundIntersection = true;
-    //        }
-
-    //    }
-    
-    //}
-   //for(size_t i = 0; i < leaf_nodes.size(); ++i)
-    //{
-    //    for(size_t j = 0; j < leaf_nodes[i]->m_triangle_idx.size(); ++j)
-    //    {
-    //        float u, v, t;
-    //        if(m_mesh->rayIntersect(leaf_nodes[i]->m_triangle_idx[j], ray, u, v, t))
-    //        {
-    //            if(shadowRay) return true;
-    //            ray.maxt = its.t = t;
-    //            its.uv = Point2f(u, v);
-    //            its.mesh = m_mesh;
-    //            f = leaf_nodes[i]->m_triangle_idx[j];
-    //            foundIntersection = true;
-    //        }
-    //    }
-    //} 
-    if (foundIntersection) {
-        /* At this point, we now know that there is an intersection,
-           and we know the triangle index of the closest such intersection.
-
-           The following computes a number of additional properties which
-           characterize the intersection (normals, texture coordinates, etc..)
-        */
-
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
-        } else {
-            its.shFrame = its.geoFrame;
+
+            if (stackSize == 0)
+                break;
+            --stackSize;
+            nodeIdx = stack[stackSize].nodeIdx;
+            active = stack[stackSize].active;
         }
     }
-
-    return foundIntersection;
 }
 
-bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) const {
-    bool foundIntersection = false;  // Was an intersection found so far?
-    uint32_t f = (uint32_t) -1;      // Triangle index of the closest intersection
+uint64_t Accel::rayIntersectShapeStream(uint32_t shapeIdx, Ray3f *rays, PreliminaryIntersection *pi,
+                                        uint64_t active) const {
+    uint64_t hits = 0;
+    for (uint32_t i = 0; i < RayStreamSize; ++i) {
+        if ((active >> i & 1) && rayIntersectShape(shapeIdx, rays[i], pi[i]))
+            hits |= (uint64_t) 1 << i;
+    }
+    return hits;
+}
 
-    Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+bool Accel::rayIntersect(const Ray3f &ray, Intersection &its) const {
+    PreliminaryIntersection pi;
+    if (!rayIntersect(ray, pi))
+        return false;
+    computeIntersection(pi, its);
+    return true;
+}
 
-    /* Brute force search through all triangles */
-    for (uint32_t idx = 0; idx < m_mesh->getTriangleCount(); ++idx) {
-        float u, v, t;
-        if (m_mesh->rayIntersect(idx, ray, u, v, t)) {
-            /* An intersection was found! Can terminate
-               immediately if this is a shadow ray query */
-            if (shadowRay)
-                return true;
-            ray.maxt = its.t = t;
-            its.uv = Point2f(u, v);
-            its.mesh = m_mesh;
-            f = idx;
-            foundIntersection = true;
+bool Accel::occluded(const Ray3f &ray) const {
+    if (m_topLevel.empty())
+        return false;
+
+    /* Any hit terminates the query, so the children are visited in storage order */
+    SlabRay sray(ray);
+    uint32_t stack[TopLevelMaxDepth];
+    uint32_t stackSize = 0;
+    uint32_t nodeIdx = 0;
+
+    while (true) {
+        const TopLevelNode &node = m_topLevel[nodeIdx];
+
+        if (node.bbox.rayIntersect(sray, ray.mint, ray.maxt)) {
+            if (node.isLeaf()) {
+                uint32_t meshIdx = node.offset, shapeIdx = m_shapeIndex[meshIdx];
+                const Instance *instance = m_instances[meshIdx];
+
+                if (instance ? occludedShape(shapeIdx, instance->getToObject() * ray)
+                             : occludedShape(shapeIdx, ray))
+                    return true;
+            } else {
+                stack[stackSize++] = node.offset;
+                nodeIdx = nodeIdx + 1;
+                continue;
+            }
         }
+
+        if (stackSize == 0)
+            break;
+        nodeIdx = stack[--stackSize];
     }
 
-    if (foundIntersection) {
-        /* At this point, we now know that there is an intersection,
-           and we know the triangle index of the closest such intersection.
-
-           The following computes a number of additional properties which
-           characterize the intersection (normals, texture coordinates, etc..)
-        */
-
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1-its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
-        } else {
-            its.shFrame = its.geoFrame;
-        }
+    return false;
+}
+
+void Accel::computeIntersection(const PreliminaryIntersection &pi, Intersection &its) const {
+    /* At this point, we now know that there is an intersection,
+       and we know the triangle index of the closest such intersection.
+
+       The following computes a number of additional properties which
+       characterize the intersection (normals, texture coordinates, etc..)
+    */
+
+    its.t = pi.t;
+    its.mesh = pi.mesh;
+    uint32_t f = pi.f;
+
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1-pi.uv.sum(), pi.uv;
+
+    /* Instanced triangles are stored in the shared mesh */
+    const Instance *instance = pi.mesh->getInstancedMesh()
+        ? static_cast<const Instance *>(pi.mesh) : nullptr;
+
+    /* References to all relevant mesh buffers */
+    const Mesh *mesh   = instance ? instance->getInstancedMesh() : pi.mesh;
+    const MatrixXf &V  = mesh->getVertexPositions();
+    const MatrixXf &N  = mesh->getVertexNormals();
+    const MatrixXf &UV = mesh->getVertexTexCoords();
+    const MatrixXu &F  = mesh->getIndices();
+
+    /* Vertex indices of the triangle */
+    uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+
+    Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+
+    /* Instanced triangles are shaded in world space */
+    if (instance) {
+        const Transform &toWorld = instance->getToWorld();
+        p0 = toWorld * p0;
+        p1 = toWorld * p1;
+        p2 = toWorld * p2;
     }
 
-    return foundIntersection;
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (UV.size() > 0)
+        its.uv = bary.x() * UV.col(idx0) +
+            bary.y() * UV.col(idx1) +
+            bary.z() * UV.col(idx2);
+    else
+        its.uv = pi.uv;
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
+
+    if (N.size() > 0) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        Normal3f n0 = N.col(idx0), n1 = N.col(idx1), n2 = N.col(idx2);
+
+        /* Transform the vertex normals in the same way as a mesh
+           loaded with a 'toWorld' transformation would */
+        if (instance) {
+            const Transform &toWorld = instance->getToWorld();
+            n0 = (toWorld * n0).normalized();
+            n1 = (toWorld * n1).normalized();
+            n2 = (toWorld * n2).normalized();
+        }
+
+        its.shFrame = Frame(
+            (bary.x() * n0 +
+             bary.y() * n1 +
+             bary.z() * n2).normalized());
+    } else {
+        its.shFrame = its.geoFrame;
+    }
 }
 
 NORI_NAMESPACE_END
-
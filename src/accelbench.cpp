@@ -0,0 +1,545 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/timer.h>
+#include <nori/block.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include <tbb/task_arena.h>
+#include <pcg32.h>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+#if defined(NORI_COUNT_ALLOCATIONS)
+/* Number of heap allocations performed by the current thread. The global
+   allocation functions are replaced below so that the benchmark can verify
+   that ray traversal does not touch the memory allocator. This is only
+   compiled into the separate 'accelbench' executable (see CMakeLists.txt),
+   so that the renderer keeps the standard allocator. */
+static thread_local uint64_t allocationCount = 0;
+
+void *operator new(std::size_t size) {
+    ++allocationCount;
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) {
+    ++allocationCount;
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+static const bool countAllocations = true;
+#else
+static const uint64_t allocationCount = 0;
+static const bool countAllocations = false;
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Ray tracing throughput benchmark for the acceleration data structures
+ *
+ * For each of the provided scenes, this test generates a set of primary rays
+ * using the scene's camera and traces them in parallel (in the same way
+ * as the main rendering loop in main.cpp), as regular queries (with and
+ * without computing the detailed intersection record) and as shadow
+ * ray (any hit) queries. Shadow rays from the primary hits towards a point
+ * light outside of the scene are traced in the same two ways. It reports
+ * the throughput and, when run by the \c accelbench executable, the number
+ * of heap allocations per ray, and fails if ray traversal allocates any
+ * memory. Finally, coherent camera rays (one per pixel, in the order in
+ * which the renderer visits the image blocks) are traced one by one and
+ * as ray streams, and the stream query must find the same intersections.
+ *
+ * When \c validationRayCount is nonzero, the closest intersections of that
+ * many rays are also compared against a brute-force search over all
+ * triangles of all meshes (using the same ray-triangle test as the
+ * acceleration data structure).
+ *
+ * When \c cache is set, the acceleration data structure (which must have a
+ * \c cacheDirectory) is rebuilt once without its cache and then once with
+ * it. The second build must load all shapes from the cache, and the closest
+ * intersections of the primary rays must not differ from the fresh build.
+ * The remaining queries then run on the structure loaded from the cache.
+ *
+ * When \c buildScaling is set, the acceleration data structure is
+ * additionally rebuilt with 1, 2, 4, .. threads (up to the number of cores)
+ * to report the speedup of the parallel build.
+ *
+ * When \c refit is set, the vertices of the meshes (except for instanced
+ * ones) are afterwards twisted about the vertical axis, and the acceleration
+ * data structure is updated using \ref Accel::refit() and then rebuilt from
+ * scratch. The update times and the throughput of primary rays are reported
+ * for both, and the refit structure is validated if \c validationRayCount
+ * is nonzero.
+ */
+class AccelBenchmark : public NoriObject {
+public:
+    AccelBenchmark(const PropertyList &propList) {
+        /* Number of rays that should be traced per scene (default: 1M) */
+        m_rayCount = propList.getInteger("rayCount", 1000000);
+
+        /* Number of rays that are checked against a brute-force search (default: none) */
+        m_validationRayCount = std::min(propList.getInteger("validationRayCount", 0), m_rayCount);
+
+        /* Check that rebuilding loads the acceleration data structure from its cache? */
+        m_cache = propList.getBoolean("cache", false);
+
+        /* Report the build time as a function of the number of threads? */
+        m_buildScaling = propList.getBoolean("buildScaling", false);
+
+        /* Compare refitting the acceleration data structure after deforming
+           the meshes to rebuilding it? */
+        m_refit = propList.getBoolean("refit", false);
+    }
+
+    virtual ~AccelBenchmark() {
+        for (auto scene : m_scenes)
+            delete scene;
+    }
+
+    void addChild(NoriObject *obj) {
+        switch (obj->getClassType()) {
+            case EScene:
+                m_scenes.push_back(static_cast<Scene *>(obj));
+                break;
+
+            default:
+                throw NoriException("AccelBenchmark::addChild(<%s>) is not supported!",
+                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    /// Run the benchmark on each of the provided scenes
+    void activate() {
+        int total = 0, passed = 0;
+
+        for (auto scene : m_scenes) {
+            const Camera *camera = scene->getCamera();
+            pcg32 random;
+
+            cout << "------------------------------------------------------" << endl;
+            cout << "Benchmarking: " << scene->getAccel()->toString() << endl;
+
+            if (m_buildScaling)
+                benchmarkBuild(scene->getAccel());
+
+            /* Generate the primary rays up front */
+            std::vector<Ray3f> rays(m_rayCount);
+            for (int i = 0; i < m_rayCount; ++i) {
+                Point2f pixelSample(
+                    random.nextFloat() * camera->getOutputSize().x(),
+                    random.nextFloat() * camera->getOutputSize().y());
+                Point2f apertureSample(random.nextFloat(), random.nextFloat());
+                camera->sampleRay(rays[i], pixelSample, apertureSample);
+            }
+
+            if (m_cache) {
+                ++total;
+                passed += checkCache(scene, rays);
+            }
+
+            if (m_validationRayCount > 0) {
+                ++total;
+                int failures = validate(scene, rays);
+                cout << tfm::format("Validation: %i/%i rays agree with a brute-force search",
+                    m_validationRayCount - failures, m_validationRayCount) << endl;
+                if (failures == 0)
+                    ++passed;
+            }
+
+            /* Shadow rays from the primary hits to a point light outside of
+               the scene, as traced by direct illumination integrators */
+            BoundingBox3f bbox = scene->getBoundingBox();
+            Point3f lightPosition = bbox.max + bbox.getExtents();
+            std::vector<Point3f> hitPoints(m_rayCount);
+            std::vector<char> hitFound(m_rayCount, 0);
+            tbb::parallel_for(0, m_rayCount, [&](int i) {
+                Intersection its;
+                if (scene->rayIntersect(rays[i], its)) {
+                    hitPoints[i] = its.p;
+                    hitFound[i] = 1;
+                }
+            });
+
+            std::vector<Ray3f> lightRays;
+            for (int i = 0; i < m_rayCount; ++i) {
+                if (!hitFound[i])
+                    continue;
+                Vector3f d = lightPosition - hitPoints[i];
+                float dist = d.norm();
+                lightRays.emplace_back(hitPoints[i], d / dist, Epsilon, dist * (1 - Epsilon));
+            }
+
+            auto closestHit = [&](const Ray3f &ray) {
+                Intersection its;
+                return scene->rayIntersect(ray, its);
+            };
+            auto preliminary = [&](const Ray3f &ray) {
+                PreliminaryIntersection pi;
+                return scene->rayIntersect(ray, pi);
+            };
+            auto occluded = [&](const Ray3f &ray) { return scene->occluded(ray); };
+
+            ++total;
+            passed += benchmarkQuery("Primary rays", rays, closestHit);
+            ++total;
+            passed += benchmarkQuery("Primary rays (preliminary)", rays, preliminary);
+            ++total;
+            passed += benchmarkQuery("Shadow rays (any hit)", rays, occluded);
+            ++total;
+            passed += benchmarkQuery("Light rays (closest hit)", lightRays, closestHit);
+            ++total;
+            passed += benchmarkQuery("Light rays (any hit)", lightRays, occluded);
+
+            std::vector<Ray3f> coherentRays = generateCoherentRays(camera, random);
+            ++total;
+            passed += benchmarkQuery("Coherent rays (preliminary)", coherentRays, preliminary);
+            ++total;
+            passed += benchmarkRange("Coherent rays (stream)", coherentRays,
+                [&](const Ray3f *rays, uint32_t count) {
+                    PreliminaryIntersection pi[Accel::RayStreamSize];
+                    uint64_t hits = 0;
+                    for (uint32_t i = 0; i < count; i += Accel::RayStreamSize) {
+                        uint32_t size = std::min(count - i, Accel::RayStreamSize);
+                        scene->rayIntersect(size, rays + i, pi);
+                        for (uint32_t j = 0; j < size; ++j)
+                            hits += pi[j].mesh != nullptr;
+                    }
+                    return hits;
+                });
+            ++total;
+            int mismatches = validateStream(scene, coherentRays);
+            cout << tfm::format("Ray streams: %i/%i rays agree with single ray queries",
+                (int) coherentRays.size() - mismatches, (int) coherentRays.size()) << endl;
+            if (mismatches == 0)
+                ++passed;
+
+            if (m_refit) {
+                twistMeshes(scene);
+
+                Accel *accel = scene->getAccel();
+                Timer timer;
+                accel->refit();
+                double refitTime = std::max(timer.elapsed(), 1.0);
+
+                if (m_validationRayCount > 0) {
+                    ++total;
+                    int failures = validate(scene, rays);
+                    cout << tfm::format("Validation (refit): %i/%i rays agree with a brute-force search",
+                        m_validationRayCount - failures, m_validationRayCount) << endl;
+                    if (failures == 0)
+                        ++passed;
+                }
+                ++total;
+                passed += benchmarkQuery("Primary rays (refit)", rays, closestHit);
+
+                timer.reset();
+                accel->build();
+                double buildTime = std::max(timer.elapsed(), 1.0);
+                ++total;
+                passed += benchmarkQuery("Primary rays (rebuilt)", rays, closestHit);
+
+                cout << tfm::format("Refit took %s, rebuild took %s (%.2fx)",
+                    timeString(refitTime), timeString(buildTime), buildTime / refitTime) << endl;
+            }
+        }
+
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+        if (passed < total)
+            throw std::runtime_error("Some tests failed :(");
+    }
+
+    /**
+     * \brief Trace the given rays in parallel and report the throughput
+     *
+     * \return \c true if ray traversal did not allocate any memory
+     */
+    template <typename Query>
+    bool benchmarkQuery(const char *name, const std::vector<Ray3f> &rays,
+                        const Query &query) const {
+        return benchmarkRange(name, rays, [&](const Ray3f *rays, uint32_t count) {
+            uint64_t hits = 0;
+            for (uint32_t i = 0; i < count; ++i) {
+                if (query(rays[i]))
+                    ++hits;
+            }
+            return hits;
+        });
+    }
+
+    /**
+     * \brief Trace the given rays in parallel using a query that processes
+     * consecutive ranges of rays and returns the number of hits
+     *
+     * \return \c true if ray traversal did not allocate any memory
+     */
+    template <typename RangeQuery>
+    bool benchmarkRange(const char *name, const std::vector<Ray3f> &rays,
+                        const RangeQuery &query) const {
+        std::atomic<uint64_t> hits(0), allocations(0);
+        int rayCount = (int) rays.size();
+
+        Timer timer;
+        tbb::blocked_range<int> range(0, rayCount, 1024);
+        tbb::parallel_for(range, [&](const tbb::blocked_range<int> &range) {
+            uint64_t allocationsBefore = allocationCount;
+            uint64_t localHits = query(&rays[range.begin()], (uint32_t) range.size());
+            allocations += allocationCount - allocationsBefore;
+            hits += localHits;
+        });
+        double elapsed = timer.elapsed();
+
+        cout << tfm::format("%s: %.2f Mrays/s (%i rays, %i hits, took %s)",
+            name, rayCount / (1000.0 * std::max(elapsed, 1.0)),
+            rayCount, (uint64_t) hits, timeString(elapsed));
+        if (countAllocations)
+            cout << tfm::format(", %.4f allocations/ray",
+                (uint64_t) allocations / (double) std::max(rayCount, 1));
+        cout << endl;
+
+        if (allocations > 0)
+            cout << "Ray traversal allocated memory!" << endl;
+        return allocations == 0;
+    }
+
+    /// Compare the first rays against a brute-force search and return the number of mismatches
+    int validate(const Scene *scene, const std::vector<Ray3f> &rays) const {
+        std::atomic<int> failures(0);
+
+        bool watertight = scene->getAccel()->isWatertight();
+
+        tbb::parallel_for(0, m_validationRayCount, [&](int i) {
+            Ray3f ray(rays[i]);
+            const Mesh *closestMesh = nullptr;
+            for (const Mesh *mesh : scene->getMeshes()) {
+                /* Instanced triangles are intersected in object space */
+                const Instance *instance = mesh->getInstancedMesh()
+                    ? static_cast<const Instance *>(mesh) : nullptr;
+                const Mesh *shape = instance ? instance->getInstancedMesh() : mesh;
+                Ray3f localRay = instance ? instance->getToObject() * ray : ray;
+                WatertightRay wray;
+                if (watertight)
+                    wray = WatertightRay(localRay);
+
+                for (uint32_t f = 0; f < shape->getTriangleCount(); ++f) {
+                    float u, v, t;
+                    bool hit = watertight
+                        ? shape->rayIntersectWatertight(f, localRay, wray, u, v, t)
+                        : shape->rayIntersect(f, localRay, u, v, t);
+                    if (hit) {
+                        ray.maxt = localRay.maxt = t;
+                        closestMesh = mesh;
+                    }
+                }
+            }
+
+            Intersection its;
+            bool hit = scene->rayIntersect(rays[i], its);
+            bool shadowHit = scene->occluded(rays[i]);
+            bool expected = closestMesh != nullptr;
+
+            if (hit != expected || shadowHit != expected ||
+                (hit && (its.mesh != closestMesh ||
+                         std::abs(its.t - ray.maxt) > 1e-4f * std::max(1.0f, ray.maxt))))
+                ++failures;
+        });
+
+        return failures;
+    }
+
+    /**
+     * \brief Rebuild the acceleration data structure without and then with
+     * its cache and compare the closest intersections of the given rays
+     *
+     * \return \c true if the second build loaded all shapes from the cache
+     * and found the same intersections as the fresh build
+     */
+    bool checkCache(Scene *scene, const std::vector<Ray3f> &rays) const {
+        Accel *accel = scene->getAccel();
+        AccelCache cache = accel->getCache();
+        if (!cache.isEnabled())
+            throw NoriException("AccelBenchmark: the acceleration data structure "
+                                "has no cacheDirectory!");
+
+        auto trace = [&](std::vector<PreliminaryIntersection> &pi) {
+            pi.resize(rays.size());
+            tbb::parallel_for(size_t(0), rays.size(), [&](size_t i) {
+                if (!scene->rayIntersect(rays[i], pi[i]))
+                    pi[i].mesh = nullptr;
+            });
+        };
+
+        std::vector<PreliminaryIntersection> expected, actual;
+        accel->setCache(AccelCache());
+        accel->build();
+        trace(expected);
+
+        accel->setCache(cache);
+        accel->build();
+        trace(actual);
+
+        int mismatches = 0;
+        for (size_t i = 0; i < rays.size(); ++i) {
+            const PreliminaryIntersection &a = actual[i], &e = expected[i];
+            if (a.mesh != e.mesh || (e.mesh && (a.f != e.f || a.t != e.t)))
+                ++mismatches;
+        }
+
+        uint32_t shapeCount = accel->getShapeCount(), cachedCount = accel->getCachedShapeCount();
+        cout << tfm::format("Cache: %i/%i shapes loaded, %i/%i rays agree with a fresh build",
+            cachedCount, shapeCount, (int) rays.size() - mismatches, (int) rays.size()) << endl;
+        if (cachedCount < shapeCount)
+            cout << "Not all shapes were loaded from the cache!" << endl;
+        return cachedCount == shapeCount && mismatches == 0;
+    }
+
+    /// Generate one camera ray per pixel in the order in which the renderer visits the image blocks
+    std::vector<Ray3f> generateCoherentRays(const Camera *camera, pcg32 &random) const {
+        Vector2i outputSize = camera->getOutputSize();
+        std::vector<Ray3f> rays;
+        rays.reserve(m_rayCount);
+
+        while (true) {
+            for (int by = 0; by < outputSize.y(); by += NORI_BLOCK_SIZE) {
+                for (int bx = 0; bx < outputSize.x(); bx += NORI_BLOCK_SIZE) {
+                    for (int y = by; y < std::min(by + NORI_BLOCK_SIZE, outputSize.y()); ++y) {
+                        for (int x = bx; x < std::min(bx + NORI_BLOCK_SIZE, outputSize.x()); ++x) {
+                            if ((int) rays.size() == m_rayCount)
+                                return rays;
+                            Point2f pixelSample(x + random.nextFloat(), y + random.nextFloat());
+                            Point2f apertureSample(random.nextFloat(), random.nextFloat());
+                            Ray3f ray;
+                            camera->sampleRay(ray, pixelSample, apertureSample);
+                            rays.push_back(ray);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /// Compare the stream query against single ray queries and return the number of mismatches
+    int validateStream(const Scene *scene, const std::vector<Ray3f> &rays) const {
+        std::atomic<int> mismatches(0);
+        uint32_t rayCount = (uint32_t) rays.size();
+
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, rayCount, Accel::RayStreamSize),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                std::vector<PreliminaryIntersection> pi(range.size());
+                scene->rayIntersect((uint32_t) range.size(), &rays[range.begin()], pi.data());
+                for (uint32_t i = range.begin(); i < range.end(); ++i) {
+                    PreliminaryIntersection expected;
+                    const PreliminaryIntersection &actual = pi[i - range.begin()];
+                    bool hit = scene->rayIntersect(rays[i], expected);
+                    /* Rays through a shared edge may report either triangle */
+                    if (hit != (actual.mesh != nullptr) ||
+                        (hit && std::abs(actual.t - expected.t) > 1e-6f * std::max(1.0f, expected.t)))
+                        ++mismatches;
+                }
+            }
+        );
+
+        return mismatches;
+    }
+
+    /// Rotate all vertices about the vertical axis by an angle that grows with their height
+    void twistMeshes(Scene *scene) const {
+        BoundingBox3f bbox = scene->getBoundingBox();
+        Point3f center = bbox.getCenter();
+        float height = std::max(bbox.getExtents().y(), Epsilon);
+
+        for (Mesh *mesh : scene->getMeshes()) {
+            /* Instanced meshes are left unchanged */
+            if (mesh->getInstancedMesh())
+                continue;
+            MatrixXf V = mesh->getVertexPositions();
+            for (int i = 0; i < V.cols(); ++i) {
+                float angle = 0.5f * M_PI * (V(1, i) - bbox.min.y()) / height;
+                float x = V(0, i) - center.x(), z = V(2, i) - center.z();
+                float sinTheta = std::sin(angle), cosTheta = std::cos(angle);
+                V(0, i) = center.x() + cosTheta * x - sinTheta * z;
+                V(2, i) = center.z() + sinTheta * x + cosTheta * z;
+            }
+            mesh->setVertexPositions(V);
+        }
+    }
+
+    /// Rebuild the acceleration data structure with an increasing number of threads
+    void benchmarkBuild(Accel *accel) const {
+        int maxThreads = (int) std::max(1u, std::thread::hardware_concurrency());
+        double baseline = 0;
+
+        for (int threads = 1; ; threads = std::min(2 * threads, maxThreads)) {
+            tbb::task_arena arena(threads);
+            Timer timer;
+            arena.execute([&] { accel->build(); });
+            double elapsed = std::max(timer.elapsed(), 1.0);
+            if (threads == 1)
+                baseline = elapsed;
+
+            cout << tfm::format("Build with %i thread(s): took %s, speedup %.2fx",
+                threads, timeString(elapsed), baseline / elapsed) << endl;
+
+            if (threads == maxThreads)
+                break;
+        }
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "AccelBenchmark[\n"
+            "  rayCount = %i,\n"
+            "  validationRayCount = %i,\n"
+            "  cache = %s,\n"
+            "  buildScaling = %s,\n"
+            "  refit = %s\n"
+            "]",
+            m_rayCount,
+            m_validationRayCount,
+            m_cache ? "true" : "false",
+            m_buildScaling ? "true" : "false",
+            m_refit ? "true" : "false"
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+private:
+    std::vector<Scene *> m_scenes;
+    int m_rayCount;
+    int m_validationRayCount;
+    bool m_cache;
+    bool m_buildScaling;
+    bool m_refit;
+};
+
+NORI_REGISTER_CLASS(AccelBenchmark, "accelbench");
+NORI_NAMESPACE_END
@@ -0,0 +1,182 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accelcache.h>
+#include <nori/mmap.h>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <atomic>
+#include <cstdio>
+
+#if defined(_WIN32)
+#  include <direct.h>
+#  include <process.h>
+#else
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Header at the beginning of every cache file
+struct AccelCacheHeader {
+    char magic[8];     ///< Identifies the file type
+    uint32_t version;  ///< \ref AccelCache::Version
+    uint32_t reserved; ///< Unused (zero)
+    uint64_t key;      ///< Hash of the shape and description (also part of the file name)
+    uint64_t size;     ///< Size of the payload that follows the header in bytes
+    uint64_t checksum; ///< Hash of the payload
+};
+
+static const char AccelCacheMagic[8] = { 'N', 'O', 'R', 'I', 'A', 'C', 'C', '\0' };
+
+uint64_t AccelCache::hash(const void *data, size_t size, uint64_t seed) {
+    /* FNV-1a over 64-bit words */
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t h = seed ^ 0xcbf29ce484222325ULL;
+    const char *ptr = (const char *) data;
+
+    for (; size >= 8; size -= 8, ptr += 8) {
+        uint64_t word;
+        memcpy(&word, ptr, 8);
+        h = (h ^ word) * prime;
+    }
+    for (; size > 0; --size, ++ptr)
+        h = (h ^ (uint8_t) *ptr) * prime;
+
+    /* Final avalanche step (from MurmurHash3) */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+std::string AccelCache::getFilename(const Mesh *shape, const std::string &description,
+                                    uint64_t &key) const {
+    const MatrixXf &V = shape->getVertexPositions();
+    const MatrixXu &F = shape->getIndices();
+    uint64_t counts[2] = { (uint64_t) V.cols(), (uint64_t) F.cols() };
+
+    key = hash(description.data(), description.size(), Version);
+    key = hash(counts, sizeof(counts), key);
+    key = hash(V.data(), sizeof(float) * V.size(), key);
+    key = hash(F.data(), sizeof(uint32_t) * F.size(), key);
+
+    std::ostringstream os;
+    os << m_directory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".accel";
+    return os.str();
+}
+
+bool AccelCache::load(const Mesh *shape, const std::string &description,
+                      const std::function<bool (Reader &)> &readFn) const {
+    if (!isEnabled())
+        return false;
+
+    uint64_t key;
+    std::string filename = getFilename(shape, description, key);
+    std::ifstream is(filename);
+    if (!is.good())
+        return false;
+    is.close();
+
+    try {
+        MemoryMappedFile file(filename);
+        const char *data = (const char *) file.getData();
+        AccelCacheHeader header;
+        if (file.getSize() < sizeof(header))
+            return false;
+        memcpy(&header, data, sizeof(header));
+
+        /* Reject truncated or otherwise corrupted payloads */
+        size_t size = file.getSize() - sizeof(header);
+        if (memcmp(header.magic, AccelCacheMagic, sizeof(AccelCacheMagic)) != 0 ||
+            header.version != Version || header.key != key || header.size != size ||
+            header.checksum != hash(data + sizeof(header), size))
+            return false;
+
+        Reader reader(data + sizeof(header), size);
+        return readFn(reader) && reader.isFinished();
+    } catch (const NoriException &) {
+        return false;
+    }
+}
+
+void AccelCache::save(const Mesh *shape, const std::string &description,
+                      const std::function<void (Writer &)> &writeFn) const {
+    if (!isEnabled())
+        return;
+
+    uint64_t key;
+    std::string filename = getFilename(shape, description, key);
+
+#if defined(_WIN32)
+    _mkdir(m_directory.c_str());
+#else
+    mkdir(m_directory.c_str(), 0755);
+#endif
+
+    Writer writer;
+    writeFn(writer);
+    const std::vector<char> &data = writer.getData();
+
+    AccelCacheHeader header;
+    memcpy(header.magic, AccelCacheMagic, sizeof(AccelCacheMagic));
+    header.version = Version;
+    header.reserved = 0;
+    header.key = key;
+    header.size = (uint64_t) data.size();
+    header.checksum = hash(data.data(), data.size());
+
+    /* Write to a temporary file first, so that other processes never see
+       a partially written cache file. Its name is unique to this process
+       and call, since other threads or processes may be writing the same
+       cache file at the same time */
+    static std::atomic<uint32_t> tmpCounter(0);
+#if defined(_WIN32)
+    int pid = _getpid();
+#else
+    int pid = (int) getpid();
+#endif
+    std::string tmpFilename = tfm::format("%s.%i.%i.tmp", filename, pid, (uint32_t) tmpCounter++);
+    std::ofstream os(tmpFilename, std::ios::binary);
+    os.write((const char *) &header, sizeof(header));
+    os.write(data.data(), (std::streamsize) data.size());
+    os.close();
+
+    if (!os.good()) {
+        cerr << "Warning: unable to write the acceleration data structure cache file \""
+             << tmpFilename << "\"" << endl;
+        std::remove(tmpFilename.c_str());
+        return;
+    }
+
+#if defined(_WIN32)
+    /* rename() does not replace existing files on Windows */
+    std::remove(filename.c_str());
+#endif
+    if (std::rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        cerr << "Warning: unable to write the acceleration data structure cache file \""
+             << filename << "\"" << endl;
+        std::remove(tmpFilename.c_str());
+    }
+}
+
+NORI_NAMESPACE_END
@@ -0,0 +1,216 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
+#include <fstream>
+#include <cstdio>
+
+NORI_NAMESPACE_BEGIN
+
+/// Header at the beginning of a binary mesh file
+struct BinaryMeshHeader {
+    char magic[8];            ///< Identifies the file type
+    uint32_t version;         ///< \ref BinaryMeshVersion
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+    uint32_t flags;           ///< Combination of \ref EBinaryMeshFlags
+    float bboxMin[3];         ///< Bounding box of the vertex positions
+    float bboxMax[3];
+    uint64_t positionOffset;  ///< Offset of the positions (3 floats per vertex)
+    uint64_t normalOffset;    ///< Offset of the normals (3 floats per vertex, if present)
+    uint64_t texcoordOffset;  ///< Offset of the texture coordinates (2 floats per vertex, if present)
+    uint64_t indexOffset;     ///< Offset of the indices (3 uint32_t per triangle)
+};
+
+enum EBinaryMeshFlags {
+    EHasNormals   = 0x1,
+    EHasTexcoords = 0x2
+};
+
+static const char BinaryMeshMagic[8] = { 'N', 'O', 'R', 'I', 'M', 'S', 'H', '\0' };
+static const uint32_t BinaryMeshVersion = 1;
+
+/// Alignment of the data blocks within the file (one cache line)
+static const uint64_t BinaryMeshAlignment = 64;
+
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + BinaryMeshAlignment - 1) / BinaryMeshAlignment * BinaryMeshAlignment;
+}
+
+void Mesh::saveBinary(const std::string &filename) const {
+    BinaryMeshHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BinaryMeshMagic, sizeof(BinaryMeshMagic));
+    header.version = BinaryMeshVersion;
+    header.vertexCount = (uint32_t) m_V.cols();
+    header.triangleCount = (uint32_t) m_F.cols();
+    header.flags = (m_N.size() > 0 ? EHasNormals : 0) | (m_UV.size() > 0 ? EHasTexcoords : 0);
+    for (int k = 0; k < 3; ++k) {
+        header.bboxMin[k] = m_bbox.min[k];
+        header.bboxMax[k] = m_bbox.max[k];
+    }
+
+    /* The blocks follow the header in this order, each one aligned */
+    struct Block {
+        uint64_t *offset;
+        const void *data;
+        size_t size;
+    } blocks[] = {
+        { &header.positionOffset, m_V.data(),  sizeof(float) * m_V.size() },
+        { &header.normalOffset,   m_N.data(),  sizeof(float) * m_N.size() },
+        { &header.texcoordOffset, m_UV.data(), sizeof(float) * m_UV.size() },
+        { &header.indexOffset,    m_F.data(),  sizeof(uint32_t) * m_F.size() }
+    };
+    uint64_t offset = sizeof(header);
+    for (Block &block : blocks) {
+        if (block.size == 0)
+            continue;
+        offset = alignOffset(offset);
+        *block.offset = offset;
+        offset += block.size;
+    }
+
+    std::ofstream os(filename, std::ios::binary);
+    os.write((const char *) &header, sizeof(header));
+    uint64_t position = sizeof(header);
+    const char padding[BinaryMeshAlignment] = { };
+    for (const Block &block : blocks) {
+        if (block.size == 0)
+            continue;
+        os.write(padding, (std::streamsize) (*block.offset - position));
+        os.write((const char *) block.data, (std::streamsize) block.size);
+        position = *block.offset + block.size;
+    }
+    os.close();
+
+    if (!os.good()) {
+        std::remove(filename.c_str());
+        throw NoriException("Unable to write the binary mesh file \"%s\"!", filename);
+    }
+}
+
+/**
+ * \brief Loader for Nori's binary mesh format
+ *
+ * The format stores the vertex positions, normals, texture coordinates
+ * and indices exactly as \ref Mesh keeps them in memory, as aligned
+ * blocks behind a small header that also holds the bounding box (for
+ * information only, the loader recomputes it). Files are written by
+ * \ref Mesh::saveBinary(), e.g. using
+ * <tt>nori --convert mesh.obj mesh.nmesh</tt>.
+ *
+ * The file is memory-mapped, and each block is copied into the mesh with
+ * a single \c memcpy(), so loading is limited only by the speed of the
+ * disk (or of the page cache). An optional \c toWorld transform is
+ * applied after loading.
+ */
+class BinaryMesh : public Mesh {
+public:
+    BinaryMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        cout << "Loading \"" << filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        MemoryMappedFile file(filename.str());
+        const char *data = (const char *) file.getData();
+
+        BinaryMeshHeader header;
+        if (file.getSize() < sizeof(header))
+            throw NoriException("\"%s\" is not a binary mesh file!", filename);
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic, BinaryMeshMagic, sizeof(BinaryMeshMagic)) != 0)
+            throw NoriException("\"%s\" is not a binary mesh file!", filename);
+        if (header.version != BinaryMeshVersion)
+            throw NoriException("\"%s\" has an unsupported version (%i) of the binary mesh format!",
+                                filename, header.version);
+
+        /* Check all blocks against the size of the file before allocating any memory */
+        uint32_t vertexCount = header.vertexCount, triangleCount = header.triangleCount;
+        bool hasNormals = (header.flags & EHasNormals) != 0, hasTexcoords = (header.flags & EHasTexcoords) != 0;
+        auto checkBlock = [&](uint64_t offset, uint64_t size) {
+            if (size > 0 && (offset % BinaryMeshAlignment != 0 || offset > file.getSize() ||
+                             file.getSize() - offset < size))
+                throw NoriException("\"%s\" is truncated or corrupt!", filename);
+        };
+        checkBlock(header.positionOffset, sizeof(float) * 3 * (uint64_t) vertexCount);
+        checkBlock(header.normalOffset, hasNormals ? sizeof(float) * 3 * (uint64_t) vertexCount : 0);
+        checkBlock(header.texcoordOffset, hasTexcoords ? sizeof(float) * 2 * (uint64_t) vertexCount : 0);
+        checkBlock(header.indexOffset, sizeof(uint32_t) * 3 * (uint64_t) triangleCount);
+
+        m_V.resize(3, vertexCount);
+        if (hasNormals)
+            m_N.resize(3, vertexCount);
+        if (hasTexcoords)
+            m_UV.resize(2, vertexCount);
+        m_F.resize(3, triangleCount);
+
+        auto readBlock = [&](uint64_t offset, void *target, size_t size) {
+            if (size > 0)
+                memcpy(target, data + offset, size);
+        };
+        readBlock(header.positionOffset, m_V.data(), sizeof(float) * m_V.size());
+        readBlock(header.normalOffset, m_N.data(), sizeof(float) * m_N.size());
+        readBlock(header.texcoordOffset, m_UV.data(), sizeof(float) * m_UV.size());
+        readBlock(header.indexOffset, m_F.data(), sizeof(uint32_t) * m_F.size());
+
+        uint32_t maxIndex = m_F.size() > 0 ? m_F.maxCoeff() : 0;
+        if (triangleCount > 0 && maxIndex >= vertexCount)
+            throw NoriException("\"%s\" references a vertex that does not exist!", filename);
+
+        /* The bounding box stored in the header is not trusted, since the
+           acceleration data structures rely on it: it is recomputed while
+           applying the transformation */
+        bool transform = !trafo.getMatrix().isIdentity();
+        m_bbox = tbb::parallel_reduce(tbb::blocked_range<uint32_t>(0, vertexCount), BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f bbox) {
+                for (uint32_t i = range.begin(); i < range.end(); ++i) {
+                    if (transform) {
+                        m_V.col(i) = trafo * Point3f(m_V.col(i));
+                        if (m_N.size() > 0)
+                            m_N.col(i) = (trafo * Normal3f(m_N.col(i))).normalized();
+                    }
+                    bbox.expandBy(m_V.col(i));
+                }
+                return bbox;
+            },
+            [](BoundingBox3f a, const BoundingBox3f &b) {
+                a.expandBy(b);
+                return a;
+            }
+        );
+
+        m_name = filename.str();
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+             << timer.elapsedString() << " and "
+             << memString(m_F.size() * sizeof(uint32_t) +
+                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+             << ")" << endl;
+    }
+};
+
+NORI_REGISTER_CLASS(BinaryMesh, "binary");
+NORI_NAMESPACE_END
@@ -0,0 +1,1102 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/triangle4.h>
+#include <nori/timer.h>
+#include <atomic>
+#include <numeric>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+
+#if defined(NORI_SSE)
+#include <emmintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy built using the surface area heuristic
+ *
+ * The hierarchy is constructed top-down: at every node, the triangle
+ * centroids are sorted into a small number of bins along each axis, and the
+ * split plane between two bins that minimizes the surface area heuristic
+ * (SAH) is chosen. Unlike the octree, every triangle is referenced by
+ * exactly one leaf.
+ *
+ * A separate hierarchy is built for each shape. Its nodes are stored in
+ * depth-first order in a single array: the first child of an interior node
+ * immediately follows its parent, and the node records the index of the
+ * second child.
+ *
+ * The triangles of each leaf are stored in packets of four (see
+ * \ref Triangle4), which are intersected using SSE instructions. Ray
+ * streams are traversed together with a mask of the rays that are still
+ * active, and each node is tested against four rays at a time (see
+ * \ref RayStream).
+ *
+ * When the \c quantized property is set (default: \c false), the nodes
+ * store their bounds with 8 bits per coordinate relative to the bounds of
+ * their parent (see \ref QuantizedBVHNode), which halves the size of the
+ * nodes at the cost of decoding the bounds during traversal.
+ *
+ * Subtrees over many triangles are built in parallel. To this end, the
+ * subtree over \c n triangles is assigned a fixed range of <tt>2n - 1</tt>
+ * nodes (an upper bound on its size), so that concurrent builds never write
+ * to the same nodes. The unused tail of each range is removed afterwards.
+ *
+ * The build can be tuned with the following properties:
+ * - \c binCount: number of SAH bins per axis (default: 16, at most 64)
+ * - \c maxLeafSize: leaves with more triangles are always split (default: 8)
+ * - \c maxDepth: maximum depth of the tree (default: 64, at most 64)
+ * - \c traversalCost: cost of visiting an interior node relative to a
+ *   packet test (default: 1)
+ * - \c intersectionCost: cost of intersecting a packet of four triangles
+ *   (default: 1)
+ * - \c quantized: store quantized node bounds (default: \c false)
+ * - \c refitThreshold: \ref refit() rebuilds a hierarchy from scratch when
+ *   updating its bounds increased its SAH cost by more than this factor
+ *   (default: 1.5)
+ */
+class BVH : public Accel {
+public:
+    BVH(const PropertyList &propList) : Accel(propList) {
+        m_binCount = propList.getInteger("binCount", 16);
+        m_maxLeafSize = propList.getInteger("maxLeafSize", 8);
+        m_maxDepth = propList.getInteger("maxDepth", (int) MaxDepthLimit);
+        m_traversalCost = propList.getFloat("traversalCost", 1.0f);
+        m_intersectionCost = propList.getFloat("intersectionCost", 1.0f);
+        m_quantized = propList.getBoolean("quantized", false);
+        m_refitThreshold = propList.getFloat("refitThreshold", 1.5f);
+
+        if (m_binCount < 2 || m_binCount > MaxBinCount)
+            throw NoriException("BVH: 'binCount' must be between 2 and %i!", (int) MaxBinCount);
+        if (m_maxLeafSize < 1 || m_maxLeafSize > 0xFFFF)
+            throw NoriException("BVH: 'maxLeafSize' must be between 1 and 65535!");
+        if (m_maxDepth < 1 || m_maxDepth > (int) MaxDepthLimit)
+            throw NoriException("BVH: 'maxDepth' must be between 1 and %i!", (int) MaxDepthLimit);
+        if (!(m_traversalCost >= 0) || !(m_intersectionCost > 0))
+            throw NoriException("BVH: the SAH costs must be positive!");
+        if (!(m_refitThreshold >= 1))
+            throw NoriException("BVH: 'refitThreshold' must be at least 1!");
+    }
+
+    void build();
+
+    /**
+     * \brief Update the bounds of the nodes after the vertex positions of
+     * the meshes have changed
+     *
+     * The hierarchies keep their topology, and their nodes are updated
+     * bottom-up. Since the triangles can move far away from the ones they
+     * were grouped with, the quality of a hierarchy can degrade over time:
+     * it is rebuilt when its SAH cost exceeds that of its last build by more
+     * than the factor \c refitThreshold.
+     */
+    void refit();
+
+    std::string toString() const {
+        return tfm::format(
+            "BVH[\n"
+            "  binCount = %i,\n"
+            "  maxLeafSize = %i,\n"
+            "  maxDepth = %i,\n"
+            "  traversalCost = %.2f,\n"
+            "  intersectionCost = %.2f,\n"
+            "  quantized = %s,\n"
+            "  refitThreshold = %.2f,\n"
+            "  watertight = %s\n"
+            "]",
+            m_binCount,
+            m_maxLeafSize,
+            m_maxDepth,
+            m_traversalCost,
+            m_intersectionCost,
+            m_quantized ? "true" : "false",
+            m_refitThreshold,
+            m_watertight ? "true" : "false"
+        );
+    }
+
+protected:
+    /// Maximum number of bins used to evaluate the surface area heuristic
+    static const int MaxBinCount = 64;
+    /// Maximum depth of the tree (bounds the size of the traversal stack)
+    static const uint32_t MaxDepthLimit = 64;
+    /// Subtrees with at least this many triangles are built in parallel
+    static const uint32_t ParallelThreshold = 4096;
+    /// Marker for nodes that were not used by the build
+    static const uint16_t UnusedNode = 0xFFFF;
+
+    /// Node of the BVH (32 bytes)
+    struct BVHNode {
+        /// Bounding box of all triangles below this node
+        BoundingBox3f bbox;
+        /// Leaf: index of the first packet in 'Tree::packets'; interior: index of the second child
+        uint32_t offset;
+        /// Leaf: number of triangles; interior: 0
+        uint16_t count;
+        /// Interior: split axis (nodes that were not used by the build are marked with 'UnusedNode')
+        uint16_t axis;
+
+        bool isLeaf() const { return count > 0; }
+
+        /// Information about the parent needed to decode the bounds (none, see \ref QuantizedBVHNode)
+        struct Frame {
+            Frame() { }
+            Frame(const BoundingBox3f &) { }
+        };
+
+        /// Return the bounds of the node
+        const BoundingBox3f &getBoundingBox(const Frame &) const { return bbox; }
+    };
+
+    /**
+     * \brief Node of the BVH with quantized bounds (16 bytes)
+     *
+     * The bounds are stored as 8-bit offsets into the (decoded) bounds of
+     * the parent node: the minimum as multiples of 1/255 of the parent's
+     * extents above its minimum, and the maximum as multiples below its
+     * maximum. They are rounded outwards, so that the decoded bounds always
+     * contain the triangles below the node. The root decodes to the bounds
+     * of the entire tree.
+     */
+    struct QuantizedBVHNode {
+        /// Leaf: index of the first packet in 'Tree::packets'; interior: index of the second child
+        uint32_t offset;
+        /// Leaf: number of triangles; interior: 0
+        uint16_t count;
+        /// Interior: split axis
+        uint8_t axis;
+        uint8_t unused;
+        /// Quantized offsets of the minimum and maximum from those of the parent (the fourth entries are zero)
+        uint8_t qmin[4], qmax[4];
+
+        bool isLeaf() const { return count > 0; }
+
+        /// Decoded bounds of the parent along with the size of a quantization step
+        struct Frame {
+#if defined(NORI_SSE)
+            __m128 min, max, scale;
+
+            Frame() { }
+            Frame(const BoundingBox3f &bbox) {
+                min = _mm_setr_ps(bbox.min.x(), bbox.min.y(), bbox.min.z(), 0.0f);
+                max = _mm_setr_ps(bbox.max.x(), bbox.max.y(), bbox.max.z(), 0.0f);
+                scale = _mm_mul_ps(_mm_sub_ps(max, min), _mm_set1_ps(1.0f / 255.0f));
+            }
+#else
+            BoundingBox3f bbox;
+            Vector3f scale;
+
+            Frame() { }
+            Frame(const BoundingBox3f &bbox)
+                : bbox(bbox), scale(bbox.getExtents() * (1.0f / 255.0f)) { }
+#endif
+        };
+
+        /// Decode the bounds of the node
+        BoundingBox3f getBoundingBox(const Frame &parent) const {
+#if defined(NORI_SSE)
+            /* Widen the eight offsets to 32-bit integers and convert them */
+            __m128i zero = _mm_setzero_si128();
+            __m128i q = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) qmin), zero);
+            __m128 lower = _mm_cvtepi32_ps(_mm_unpacklo_epi16(q, zero));
+            __m128 upper = _mm_cvtepi32_ps(_mm_unpackhi_epi16(q, zero));
+
+            alignas(16) float min[4], max[4];
+            _mm_store_ps(min, _mm_add_ps(parent.min, _mm_mul_ps(lower, parent.scale)));
+            _mm_store_ps(max, _mm_sub_ps(parent.max, _mm_mul_ps(upper, parent.scale)));
+            return BoundingBox3f(Point3f(min[0], min[1], min[2]), Point3f(max[0], max[1], max[2]));
+#else
+            BoundingBox3f bbox;
+            for (int k = 0; k < 3; ++k) {
+                bbox.min[k] = parent.bbox.min[k] + qmin[k] * parent.scale[k];
+                bbox.max[k] = parent.bbox.max[k] - qmax[k] * parent.scale[k];
+            }
+            return bbox;
+#endif
+        }
+    };
+
+    /**
+     * \brief Origins, reciprocal directions and extents of the rays of a
+     * stream in SoA layout, so that four rays can be tested against a node
+     * at once
+     *
+     * Performs the same slab test as \ref TBoundingBox::rayIntersect(const SlabRay &, float, float) const.
+     */
+    struct RayStream {
+        alignas(16) float o[3][RayStreamSize];
+        alignas(16) float dRcp[3][RayStreamSize];
+        alignas(16) uint32_t negative[3][RayStreamSize]; ///< All bits set if the direction component is negative
+        alignas(16) float mint[RayStreamSize];
+        alignas(16) float maxt[RayStreamSize];
+
+        /// Copy the active rays (the others never hit anything)
+        RayStream(const Ray3f *rays, uint64_t active) {
+            for (uint32_t i = 0; i < RayStreamSize; ++i) {
+                bool isActive = (active >> i & 1) != 0;
+                SlabRay sray;
+                if (isActive)
+                    sray = SlabRay(rays[i]);
+                for (int k = 0; k < 3; ++k) {
+                    o[k][i] = isActive ? sray.o[k] : 0.0f;
+                    dRcp[k][i] = isActive ? sray.dRcp[k] : 1.0f;
+                    negative[k][i] = isActive && sray.sign[k] ? 0xFFFFFFFFu : 0u;
+                }
+                mint[i] = isActive ? rays[i].mint : 1.0f;
+                maxt[i] = isActive ? rays[i].maxt : 0.0f;
+            }
+        }
+
+        /// Return the mask of the rays among \c active that intersect the box
+        uint64_t intersect(const BoundingBox3f &bbox, uint64_t active) const {
+            const float scale = 1.0f + 6.0f * std::numeric_limits<float>::epsilon();
+            uint64_t result = 0;
+
+            for (uint32_t i = 0; i < RayStreamSize; i += 4) {
+                uint32_t groupMask = (uint32_t) (active >> i) & 0xF;
+                if (!groupMask)
+                    continue;
+#if defined(NORI_SSE)
+                __m128 nearT = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+                __m128 farT = _mm_set1_ps(std::numeric_limits<float>::infinity());
+                for (int k = 0; k < 3; ++k) {
+                    __m128 origin = _mm_load_ps(o[k] + i), rcp = _mm_load_ps(dRcp[k] + i);
+                    __m128 neg = _mm_castsi128_ps(_mm_load_si128((const __m128i *) (negative[k] + i)));
+                    __m128 lower = _mm_set1_ps(bbox.min[k]), upper = _mm_set1_ps(bbox.max[k]);
+                    __m128 nearPlane = _mm_or_ps(_mm_and_ps(neg, upper), _mm_andnot_ps(neg, lower));
+                    __m128 farPlane = _mm_or_ps(_mm_and_ps(neg, lower), _mm_andnot_ps(neg, upper));
+                    __m128 t1 = _mm_mul_ps(_mm_sub_ps(nearPlane, origin), rcp);
+                    __m128 t2 = _mm_mul_ps(_mm_sub_ps(farPlane, origin), rcp);
+
+                    /* MAXPS/MINPS return the second operand if the first one is NaN */
+                    nearT = _mm_max_ps(t1, nearT);
+                    farT = _mm_min_ps(t2, farT);
+                }
+                nearT = _mm_max_ps(nearT, _mm_load_ps(mint + i));
+                farT = _mm_min_ps(_mm_mul_ps(farT, _mm_set1_ps(scale)), _mm_load_ps(maxt + i));
+                result |= (uint64_t) (_mm_movemask_ps(_mm_cmple_ps(nearT, farT)) & groupMask) << i;
+#else
+                for (uint32_t j = i; j < i + 4; ++j) {
+                    float nearT = -std::numeric_limits<float>::infinity();
+                    float farT = std::numeric_limits<float>::infinity();
+                    for (int k = 0; k < 3; ++k) {
+                        float t1 = ((negative[k][j] ? bbox.max[k] : bbox.min[k]) - o[k][j]) * dRcp[k][j];
+                        float t2 = ((negative[k][j] ? bbox.min[k] : bbox.max[k]) - o[k][j]) * dRcp[k][j];
+                        nearT = std::max(nearT, t1);
+                        farT = std::min(farT, t2);
+                    }
+                    if (std::max(nearT, mint[j]) <= std::min(farT * scale, maxt[j]))
+                        result |= (uint64_t) (groupMask >> (j - i) & 1) << j;
+                }
+#endif
+            }
+            return result;
+        }
+    };
+
+    /// Bottom-level hierarchy over the triangles of a single mesh
+    struct Tree {
+        std::vector<BVHNode>          nodes;          ///< Nodes in depth-first order
+        std::vector<QuantizedBVHNode> quantizedNodes; ///< Quantized nodes (replace 'nodes' if enabled)
+        std::vector<Triangle4>        packets;        ///< Triangles of the leaves in packets of four
+        BoundingBox3f                 bbox;           ///< Bounds of the root (used to decode the quantized nodes)
+        BuildStatistics               stats;          ///< Statistics collected during the last build
+    };
+
+    /// Temporary data used while building the hierarchy of a single mesh
+    struct BuildContext {
+        std::vector<BVHNode>       &nodes;
+        std::vector<uint32_t>      indices;   ///< Triangle indices referenced by the leaves
+        std::vector<BoundingBox3f> triBBox;   ///< Triangle bounding boxes
+        std::vector<Point3f>       centroids; ///< Triangle centroids
+    };
+
+    /// Centroid bins of all three axes used to evaluate the SAH
+    struct SAHBins {
+        BoundingBox3f bbox[3][MaxBinCount];
+        uint32_t count[3][MaxBinCount];
+        int binCount;
+
+        SAHBins(int binCount) : binCount(binCount) { memset(count, 0, sizeof(count)); }
+
+        void merge(const SAHBins &bins) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int i = 0; i < binCount; ++i) {
+                    bbox[axis][i].expandBy(bins.bbox[axis][i]);
+                    count[axis][i] += bins.count[axis][i];
+                }
+            }
+        }
+    };
+
+    /// Build the hierarchy over the triangles of the given mesh
+    void buildTree(const Mesh *mesh, Tree &tree);
+
+    /// Update the bounds of the hierarchy and return its new SAH cost
+    float refitTree(const Mesh *mesh, Tree &tree) const;
+
+    /**
+     * \brief Recursively build the subtree over 'ctx.indices[start, end)'
+     *
+     * The root of the subtree is stored at 'nodeIdx', and the subtree
+     * occupies (at most) the nodes '[nodeIdx, nodeIdx + 2 * (end - start) - 1)'.
+     */
+    void buildRecursive(BuildContext &ctx, uint32_t nodeIdx, uint32_t start,
+                        uint32_t end, uint32_t depth, BuildStatistics &stats);
+
+    /// Remove the nodes that were not used by the build and update the child indices
+    static void compactNodes(std::vector<BVHNode> &nodes);
+
+    /// Copy the triangles of each leaf into packets and point the leaves to them
+    static void buildPackets(const Mesh *mesh, const BuildContext &ctx, Tree &tree);
+
+    /// Replace the nodes of the tree by quantized nodes
+    static void quantizeNodes(Tree &tree);
+
+    bool rayIntersectShape(uint32_t shapeIdx, Ray3f &ray, PreliminaryIntersection &pi) const;
+
+    bool occludedShape(uint32_t shapeIdx, const Ray3f &ray) const;
+
+    uint64_t rayIntersectShapeStream(uint32_t shapeIdx, Ray3f *rays, PreliminaryIntersection *pi,
+                                     uint64_t active) const;
+
+    /// Closest-hit traversal of either node layout
+    template <typename Node>
+    bool rayIntersectTree(const std::vector<Node> &nodes, const Tree &tree, Ray3f &ray,
+                          PreliminaryIntersection &pi) const;
+
+    /// Closest-hit traversal of a ray stream for either node layout
+    template <typename Node>
+    uint64_t rayIntersectTreeStream(const std::vector<Node> &nodes, const Tree &tree, Ray3f *rays,
+                                    PreliminaryIntersection *pi, uint64_t active) const;
+
+    /// Any-hit traversal of either node layout
+    template <typename Node>
+    bool occludedTree(const std::vector<Node> &nodes, const Tree &tree, const Ray3f &ray) const;
+
+    /// Number of packets needed to store the given number of triangles
+    static uint32_t packetCount(uint32_t count) { return (count + 3) / 4; }
+
+    /// SAH cost of a leaf with the given number of triangles (relative to its area)
+    float leafCost(uint32_t count) const { return m_intersectionCost * packetCount(count); }
+
+protected:
+    std::vector<Tree> m_trees;    ///< Hierarchies of the individual meshes
+    int m_binCount;               ///< Number of SAH bins per axis
+    int m_maxLeafSize;            ///< Leaves with more triangles are always split
+    int m_maxDepth;               ///< Maximum depth of the tree
+    float m_traversalCost;        ///< SAH cost of visiting an interior node
+    float m_intersectionCost;     ///< SAH cost of intersecting a packet of four triangles
+    bool m_quantized;             ///< Store quantized node bounds?
+    float m_refitThreshold;       ///< Relative increase of the SAH cost that triggers a rebuild
+};
+
+void BVH::build() {
+    m_trees.clear();
+    m_trees.resize(m_shapes.size());
+
+    cout << "Building BVH .. ";
+    cout.flush();
+    Timer timer;
+
+    /* The shapes are built concurrently, and so are large subtrees within
+       them. Shapes that were built by a previous run are read from the cache */
+    std::atomic<uint32_t> cachedCount(0);
+    std::string description = toString();
+    tbb::parallel_for(size_t(0), m_shapes.size(), [&](size_t i) {
+        Tree &tree = m_trees[i];
+        bool cached = m_cache.load(m_shapes[i], description, [&](AccelCache::Reader &reader) {
+            return reader.read(tree.nodes) && reader.read(tree.quantizedNodes) &&
+                   reader.read(tree.packets) && reader.read(tree.bbox) && reader.read(tree.stats);
+        });
+
+        if (cached) {
+            ++cachedCount;
+        } else {
+            buildTree(m_shapes[i], tree);
+            if (m_quantized)
+                quantizeNodes(tree);
+            m_cache.save(m_shapes[i], description, [&](AccelCache::Writer &writer) {
+                writer.write(tree.nodes);
+                writer.write(tree.quantizedNodes);
+                writer.write(tree.packets);
+                writer.write(tree.bbox);
+                writer.write(tree.stats);
+            });
+        }
+    });
+    buildTopLevel();
+
+    BuildStatistics stats;
+    size_t totalPackets = 0;
+    size_t nodeMemory = 0;
+    for (size_t i = 0; i < m_trees.size(); ++i) {
+        stats.merge(m_trees[i].stats);
+        nodeMemory += m_trees[i].nodes.size() * sizeof(BVHNode) +
+                      m_trees[i].quantizedNodes.size() * sizeof(QuantizedBVHNode);
+        totalPackets += m_trees[i].packets.size();
+    }
+
+    m_cachedCount = cachedCount;
+    printBuildReport(stats, cachedCount, nodeMemory,
+                     totalPackets * sizeof(Triangle4), timer.elapsed());
+}
+
+void BVH::buildTree(const Mesh *mesh, Tree &tree) {
+    uint32_t triCount = mesh->getTriangleCount();
+    if (triCount == 0)
+        return;
+
+    BuildContext ctx { tree.nodes, {}, {}, {} };
+    ctx.indices.resize(triCount);
+    ctx.triBBox.resize(triCount);
+    ctx.centroids.resize(triCount);
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0, triCount),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i < range.end(); ++i) {
+                ctx.indices[i] = i;
+                ctx.triBBox[i] = mesh->getBoundingBox(i);
+                ctx.centroids[i] = ctx.triBBox[i].getCenter();
+            }
+        }
+    );
+
+    /* A binary tree with at least one triangle per leaf has fewer than 2N nodes */
+    BVHNode unused;
+    unused.offset = 0;
+    unused.count = 0;
+    unused.axis = UnusedNode;
+    ctx.nodes.resize(2 * triCount - 1, unused);
+
+    buildRecursive(ctx, 0, 0, triCount, 1, tree.stats);
+    compactNodes(ctx.nodes);
+    buildPackets(mesh, ctx, tree);
+    tree.bbox = tree.nodes[0].bbox;
+}
+
+void BVH::buildRecursive(BuildContext &ctx, uint32_t nodeIdx, uint32_t start,
+                         uint32_t end, uint32_t depth, BuildStatistics &stats) {
+    std::vector<BVHNode> &nodes = ctx.nodes;
+    std::vector<uint32_t> &indices = ctx.indices;
+
+    uint32_t count = end - start;
+    bool parallel = count >= ParallelThreshold;
+    tbb::blocked_range<uint32_t> range(start, end, ParallelThreshold / 4);
+
+    /* Compute the bounding box of the triangles and of their centroids */
+    typedef std::pair<BoundingBox3f, BoundingBox3f> BoundsPair;
+    auto computeBounds = [&](const tbb::blocked_range<uint32_t> &range, BoundsPair bounds) {
+        for (uint32_t i = range.begin(); i < range.end(); ++i) {
+            bounds.first.expandBy(ctx.triBBox[indices[i]]);
+            bounds.second.expandBy(ctx.centroids[indices[i]]);
+        }
+        return bounds;
+    };
+    auto mergeBounds = [](BoundsPair a, const BoundsPair &b) {
+        a.first.expandBy(b.first);
+        a.second.expandBy(b.second);
+        return a;
+    };
+    BoundsPair bounds = parallel
+        ? tbb::parallel_reduce(range, BoundsPair(), computeBounds, mergeBounds)
+        : computeBounds(range, BoundsPair());
+    const BoundingBox3f &bbox = bounds.first, &centroidBBox = bounds.second;
+
+    nodes[nodeIdx].bbox = bbox;
+
+    /* Surface area of the root node, used to normalize the SAH cost */
+    float rootArea = nodes[0].bbox.getSurfaceArea();
+
+    auto makeLeaf = [&]() {
+        if (count > 0xFFFF)
+            throw NoriException("BVH: a leaf at the maximum depth has %i triangles, "
+                                "increase 'maxDepth'!", count);
+        BVHNode &node = nodes[nodeIdx];
+        node.offset = start;
+        node.count = (uint16_t) count;
+        node.axis = 0;
+        stats.addLeaf(depth, count, leafCost(count) * bbox.getSurfaceArea() / rootArea);
+    };
+
+    if (count == 1 || depth >= (uint32_t) m_maxDepth)
+        return makeLeaf();
+
+    /* Sort the centroids into bins along each axis */
+    int numBins = m_binCount;
+    Vector3f extents = centroidBBox.getExtents();
+    Vector3f scale;
+    for (int axis = 0; axis < 3; ++axis)
+        scale[axis] = extents[axis] > 0 ? numBins / extents[axis] : 0.0f;
+
+    auto binIndex = [&](uint32_t idx, int axis) {
+        return std::min(numBins - 1,
+            (int) ((ctx.centroids[idx][axis] - centroidBBox.min[axis]) * scale[axis]));
+    };
+    auto computeBins = [&](const tbb::blocked_range<uint32_t> &range, SAHBins bins) {
+        for (uint32_t i = range.begin(); i < range.end(); ++i) {
+            uint32_t idx = indices[i];
+            for (int axis = 0; axis < 3; ++axis) {
+                int bin = binIndex(idx, axis);
+                bins.count[axis][bin]++;
+                bins.bbox[axis][bin].expandBy(ctx.triBBox[idx]);
+            }
+        }
+        return bins;
+    };
+    auto mergeBins = [](SAHBins a, const SAHBins &b) {
+        a.merge(b);
+        return a;
+    };
+    SAHBins bins = parallel
+        ? tbb::parallel_reduce(range, SAHBins(numBins), computeBins, mergeBins)
+        : computeBins(range, SAHBins(numBins));
+
+    /* Find the best split plane along each axis using binned SAH */
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestAxis = -1, bestBin = -1;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (extents[axis] <= 0)
+            continue;
+
+        const BoundingBox3f *binBBox = bins.bbox[axis];
+        const uint32_t *binCount = bins.count[axis];
+
+        /* Sweep from the right to compute the suffix areas and counts */
+        float rightArea[MaxBinCount];
+        uint32_t rightCount[MaxBinCount];
+        BoundingBox3f accum;
+        uint32_t accumCount = 0;
+        for (int i = numBins - 1; i > 0; --i) {
+            accum.expandBy(binBBox[i]);
+            accumCount += binCount[i];
+            rightArea[i] = accumCount > 0 ? accum.getSurfaceArea() : 0.0f;
+            rightCount[i] = accumCount;
+        }
+
+        /* Sweep from the left and evaluate the cost of each split */
+        accum.reset();
+        accumCount = 0;
+        for (int i = 0; i < numBins - 1; ++i) {
+            accum.expandBy(binBBox[i]);
+            accumCount += binCount[i];
+            if (accumCount == 0 || rightCount[i + 1] == 0)
+                continue;
+            float cost = packetCount(accumCount) * accum.getSurfaceArea()
+                       + packetCount(rightCount[i + 1]) * rightArea[i + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = i;
+            }
+        }
+    }
+
+    float invArea = 1.0f / bbox.getSurfaceArea();
+    bestCost = m_traversalCost + m_intersectionCost * bestCost * invArea;
+
+    if (count <= (uint32_t) m_maxLeafSize && (bestAxis == -1 || leafCost(count) <= bestCost)) {
+        /* Creating a leaf is cheaper than any split (or all centroids coincide) */
+        return makeLeaf();
+    }
+
+    uint32_t split = start + count / 2;
+    if (bestAxis != -1) {
+        uint32_t *mid = std::partition(&indices[start], &indices[0] + end,
+            [&](uint32_t idx) { return binIndex(idx, bestAxis) <= bestBin; });
+        split = (uint32_t) (mid - &indices[0]);
+    }
+
+    if (bestAxis == -1 || split == start || split == end) {
+        /* Fall back to a median split along the longest axis */
+        bestAxis = bestAxis == -1 ? centroidBBox.getMajorAxis() : bestAxis;
+        split = start + count / 2;
+        std::nth_element(&indices[start], &indices[split], &indices[0] + end,
+            [&](uint32_t a, uint32_t b) {
+                return ctx.centroids[a][bestAxis] < ctx.centroids[b][bestAxis];
+            });
+    }
+
+    stats.addInterior(m_traversalCost * bbox.getSurfaceArea() / rootArea);
+
+    uint32_t leftChild = nodeIdx + 1;
+    uint32_t rightChild = nodeIdx + 2 * (split - start);
+
+    BVHNode &node = nodes[nodeIdx];
+    node.offset = rightChild;
+    node.count = 0;
+    node.axis = (uint16_t) bestAxis;
+
+    if (parallel) {
+        BuildStatistics rightStats;
+        tbb::parallel_invoke(
+            [&] { buildRecursive(ctx, leftChild, start, split, depth + 1, stats); },
+            [&] { buildRecursive(ctx, rightChild, split, end, depth + 1, rightStats); }
+        );
+        stats.merge(rightStats);
+    } else {
+        buildRecursive(ctx, leftChild, start, split, depth + 1, stats);
+        buildRecursive(ctx, rightChild, split, end, depth + 1, stats);
+    }
+}
+
+void BVH::compactNodes(std::vector<BVHNode> &nodes) {
+    /* The ranges assigned to the subtrees are laid out in depth-first order,
+       so dropping the unused nodes preserves the order of the used ones */
+    std::vector<uint32_t> newIndex(nodes.size());
+    uint32_t nodeCount = 0;
+    for (uint32_t i = 0; i < nodes.size(); ++i) {
+        if (nodes[i].axis != UnusedNode)
+            newIndex[i] = nodeCount++;
+    }
+
+    for (uint32_t i = 0; i < nodes.size(); ++i) {
+        BVHNode node = nodes[i];
+        if (node.axis == UnusedNode)
+            continue;
+        if (!node.isLeaf())
+            node.offset = newIndex[node.offset];
+        nodes[newIndex[i]] = node;
+    }
+
+    nodes.resize(nodeCount);
+    nodes.shrink_to_fit();
+}
+
+void BVH::buildPackets(const Mesh *mesh, const BuildContext &ctx, Tree &tree) {
+    uint32_t totalPackets = 0;
+    for (const BVHNode &node : tree.nodes) {
+        if (node.isLeaf())
+            totalPackets += packetCount(node.count);
+    }
+
+    tree.packets.resize(totalPackets);
+    uint32_t packetIdx = 0;
+    for (BVHNode &node : tree.nodes) {
+        if (!node.isLeaf())
+            continue;
+        for (uint32_t i = 0; i < node.count; ++i)
+            tree.packets[packetIdx + i / 4].set(i % 4, mesh, ctx.indices[node.offset + i]);
+        node.offset = packetIdx;
+        packetIdx += packetCount(node.count);
+    }
+}
+
+void BVH::quantizeNodes(Tree &tree) {
+    const std::vector<BVHNode> &nodes = tree.nodes;
+    std::vector<QuantizedBVHNode> &quantized = tree.quantizedNodes;
+    quantized.resize(nodes.size());
+
+    /* Decoded bounds of each node. Parents precede their children in
+       depth-first order, so their bounds are always known in time */
+    std::vector<BoundingBox3f> decoded(nodes.size());
+    std::vector<uint32_t> parent(nodes.size(), 0);
+
+    for (uint32_t i = 0; i < (uint32_t) nodes.size(); ++i) {
+        const BVHNode &node = nodes[i];
+        QuantizedBVHNode &qnode = quantized[i];
+        qnode.offset = node.offset;
+        qnode.count = node.count;
+        qnode.axis = (uint8_t) node.axis;
+        qnode.unused = 0;
+        qnode.qmin[3] = qnode.qmax[3] = 0;
+
+        if (!node.isLeaf()) {
+            parent[i + 1] = i;
+            parent[node.offset] = i;
+        }
+
+        const BoundingBox3f &parentBBox = i == 0 ? tree.bbox : decoded[parent[i]];
+        QuantizedBVHNode::Frame frame(parentBBox);
+        Vector3f extents = parentBBox.getExtents();
+        for (int k = 0; k < 3; ++k) {
+            float scale = extents[k] > 0 ? 255.0f / extents[k] : 0.0f;
+            float lower = std::floor((node.bbox.min[k] - parentBBox.min[k]) * scale);
+            float upper = std::floor((parentBBox.max[k] - node.bbox.max[k]) * scale);
+            qnode.qmin[k] = (uint8_t) std::min(std::max(lower, 0.0f), 255.0f);
+            qnode.qmax[k] = (uint8_t) std::min(std::max(upper, 0.0f), 255.0f);
+        }
+
+        /* Round outwards until the decoded bounds (computed exactly as
+           during traversal) contain the node. Offsets of zero decode to
+           the bounds of the parent, which contain the node */
+        while (true) {
+            BoundingBox3f bbox = qnode.getBoundingBox(frame);
+            bool done = true;
+            for (int k = 0; k < 3; ++k) {
+                if (bbox.min[k] > node.bbox.min[k] && qnode.qmin[k] > 0) {
+                    qnode.qmin[k]--;
+                    done = false;
+                }
+                if (bbox.max[k] < node.bbox.max[k] && qnode.qmax[k] > 0) {
+                    qnode.qmax[k]--;
+                    done = false;
+                }
+            }
+            if (done) {
+                decoded[i] = bbox;
+                break;
+            }
+        }
+    }
+
+    std::vector<BVHNode>().swap(tree.nodes);
+}
+
+void BVH::refit() {
+    cout << "Refitting BVH .. ";
+    cout.flush();
+    Timer timer;
+
+    updateBoundingBoxes();
+
+    /* Hierarchies whose quality degraded too much are rebuilt. Refitted
+       hierarchies no longer match the cached ones, so they are not saved */
+    std::atomic<uint32_t> rebuiltCount(0);
+    std::vector<float> oldCost(m_trees.size()), newCost(m_trees.size());
+    tbb::parallel_for(size_t(0), m_trees.size(), [&](size_t i) {
+        Tree &tree = m_trees[i];
+        oldCost[i] = tree.stats.sahCost;
+        newCost[i] = refitTree(m_shapes[i], tree);
+        if (newCost[i] > m_refitThreshold * tree.stats.sahCost) {
+            tree = Tree();
+            buildTree(m_shapes[i], tree);
+            if (m_quantized)
+                quantizeNodes(tree);
+            newCost[i] = tree.stats.sahCost;
+            ++rebuiltCount;
+        }
+    });
+    buildTopLevel();
+
+    cout << "done. (took " << timeString(timer.elapsed()) << ", "
+         << rebuiltCount << "/" << m_trees.size() << " shapes rebuilt, SAH cost "
+         << std::accumulate(oldCost.begin(), oldCost.end(), 0.0f) << " -> "
+         << std::accumulate(newCost.begin(), newCost.end(), 0.0f) << ")" << endl;
+}
+
+float BVH::refitTree(const Mesh *mesh, Tree &tree) const {
+    std::vector<BVHNode> &nodes = tree.nodes;
+    if (m_quantized) {
+        /* Recover the topology from the quantized nodes */
+        nodes.resize(tree.quantizedNodes.size());
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            const QuantizedBVHNode &qnode = tree.quantizedNodes[i];
+            nodes[i].offset = qnode.offset;
+            nodes[i].count = qnode.count;
+            nodes[i].axis = qnode.axis;
+        }
+    }
+    if (nodes.empty())
+        return 0.0f;
+
+    /* Fetch the new vertex positions of the triangles in the packets */
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, tree.packets.size()),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                Triangle4 &packet = tree.packets[i];
+                for (int lane = 0; lane < 4; ++lane) {
+                    if (packet.index[lane] != (uint32_t) -1)
+                        packet.set(lane, mesh, packet.index[lane]);
+                }
+            }
+        }
+    );
+
+    /* Compute the bounds of the leaves */
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size()),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                BVHNode &node = nodes[i];
+                if (!node.isLeaf())
+                    continue;
+                node.bbox.reset();
+                for (uint32_t j = 0; j < node.count; ++j) {
+                    Point3f p0, p1, p2;
+                    tree.packets[node.offset + j / 4].getVertices(j % 4, p0, p1, p2);
+                    node.bbox.expandBy(p0);
+                    node.bbox.expandBy(p1);
+                    node.bbox.expandBy(p2);
+                }
+            }
+        }
+    );
+
+    /* Children follow their parents in depth-first order, so a reverse
+       pass updates the interior nodes bottom-up */
+    for (size_t i = nodes.size(); i-- > 0; ) {
+        BVHNode &node = nodes[i];
+        if (node.isLeaf())
+            continue;
+        node.bbox = nodes[i + 1].bbox;
+        node.bbox.expandBy(nodes[node.offset].bbox);
+    }
+
+    float rootArea = nodes[0].bbox.getSurfaceArea(), cost = 0.0f;
+    for (const BVHNode &node : nodes) {
+        float area = node.bbox.getSurfaceArea() / rootArea;
+        cost += area * (node.isLeaf() ? leafCost(node.count) : m_traversalCost);
+    }
+
+    tree.bbox = nodes[0].bbox;
+    if (m_quantized)
+        quantizeNodes(tree);
+
+    return cost;
+}
+
+bool BVH::rayIntersectShape(uint32_t shapeIdx, Ray3f &ray, PreliminaryIntersection &pi) const {
+    const Tree &tree = m_trees[shapeIdx];
+    return m_quantized ? rayIntersectTree(tree.quantizedNodes, tree, ray, pi)
+                       : rayIntersectTree(tree.nodes, tree, ray, pi);
+}
+
+bool BVH::occludedShape(uint32_t shapeIdx, const Ray3f &ray) const {
+    const Tree &tree = m_trees[shapeIdx];
+    return m_quantized ? occludedTree(tree.quantizedNodes, tree, ray)
+                       : occludedTree(tree.nodes, tree, ray);
+}
+
+template <typename Node>
+bool BVH::rayIntersectTree(const std::vector<Node> &nodes, const Tree &tree, Ray3f &ray,
+                           PreliminaryIntersection &pi) const {
+    const std::vector<Triangle4> &packets = tree.packets;
+    if (nodes.empty())
+        return false;
+
+    bool foundIntersection = false;  // Was an intersection found so far?
+
+    /* Ray-dependent setup of the slab test (shared by all nodes) and of
+       the watertight test (shared by all triangles) */
+    SlabRay sray(ray);
+    WatertightRay wray;
+    if (m_watertight)
+        wray = WatertightRay(ray);
+
+    /* Visit the child on the near side of the split plane first. The
+       other one is pushed onto a fixed-size stack (at most one entry per
+       level) along with the information needed to decode its bounds */
+    bool dirIsNeg[3] = { ray.d.x() < 0, ray.d.y() < 0, ray.d.z() < 0 };
+    typedef typename Node::Frame Frame;
+    uint32_t stack[MaxDepthLimit];
+    Frame frames[MaxDepthLimit];
+    uint32_t stackSize = 0;
+    uint32_t nodeIdx = 0;
+    Frame parent(tree.bbox);
+
+    while (true) {
+        const Node &node = nodes[nodeIdx];
+        const BoundingBox3f &bbox = node.getBoundingBox(parent);
+
+        /* Nodes beyond the closest intersection found so far are skipped,
+           since the ray's 'maxt' value shrinks with every hit */
+        if (bbox.rayIntersect(sray, ray.mint, ray.maxt)) {
+            if (node.isLeaf()) {
+                uint32_t packetEnd = node.offset + packetCount(node.count);
+                for (uint32_t i = node.offset; i < packetEnd; ++i) {
+                    float u, v, t;
+                    uint32_t idx;
+                    bool hit = m_watertight
+                        ? packets[i].rayIntersectWatertight(ray, wray, u, v, t, idx)
+                        : packets[i].rayIntersect(ray, u, v, t, idx);
+                    if (hit) {
+                        ray.maxt = pi.t = t;
+                        pi.uv = Point2f(u, v);
+                        pi.f = idx;
+                        foundIntersection = true;
+                    }
+                }
+            } else {
+                parent = Frame(bbox);
+                frames[stackSize] = parent;
+                if (dirIsNeg[node.axis]) {
+                    stack[stackSize++] = nodeIdx + 1;
+                    nodeIdx = node.offset;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    nodeIdx = nodeIdx + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+            break;
+        --stackSize;
+        nodeIdx = stack[stackSize];
+        parent = frames[stackSize];
+    }
+
+    return foundIntersection;
+}
+
+uint64_t BVH::rayIntersectShapeStream(uint32_t shapeIdx, Ray3f *rays, PreliminaryIntersection *pi,
+                                      uint64_t active) const {
+    const Tree &tree = m_trees[shapeIdx];
+    return m_quantized ? rayIntersectTreeStream(tree.quantizedNodes, tree, rays, pi, active)
+                       : rayIntersectTreeStream(tree.nodes, tree, rays, pi, active);
+}
+
+template <typename Node>
+uint64_t BVH::rayIntersectTreeStream(const std::vector<Node> &nodes, const Tree &tree, Ray3f *rays,
+                                     PreliminaryIntersection *pi, uint64_t active) const {
+    const std::vector<Triangle4> &packets = tree.packets;
+    if (nodes.empty())
+        return 0;
+
+    uint64_t hits = 0;
+    RayStream stream(rays, active);
+    WatertightRay wrays[RayStreamSize];
+    if (m_watertight) {
+        for (uint32_t i = 0; i < RayStreamSize; ++i) {
+            if (active >> i & 1)
+                wrays[i] = WatertightRay(rays[i]);
+        }
+    }
+
+    /* Same traversal as in rayIntersectTree(), but each node is visited
+       with the mask of the rays that reached its parent, from which the
+       rays that miss the node are removed. The far child is pushed onto
+       the stack along with the mask */
+    typedef typename Node::Frame Frame;
+    uint32_t stack[MaxDepthLimit];
+    uint64_t masks[MaxDepthLimit];
+    Frame frames[MaxDepthLimit];
+    uint32_t stackSize = 0;
+    uint32_t nodeIdx = 0;
+    Frame parent(tree.bbox);
+
+    while (true) {
+        const Node &node = nodes[nodeIdx];
+        const BoundingBox3f &bbox = node.getBoundingBox(parent);
+        active = stream.intersect(bbox, active);
+
+        if (active) {
+            if (node.isLeaf()) {
+                uint32_t packetEnd = node.offset + packetCount(node.count);
+                for (uint32_t i = 0; i < RayStreamSize; ++i) {
+                    if (!(active >> i & 1))
+                        continue;
+                    Ray3f &ray = rays[i];
+                    for (uint32_t j = node.offset; j < packetEnd; ++j) {
+                        float u, v, t;
+                        uint32_t idx;
+                        bool hit = m_watertight
+                            ? packets[j].rayIntersectWatertight(ray, wrays[i], u, v, t, idx)
+                            : packets[j].rayIntersect(ray, u, v, t, idx);
+                        if (hit) {
+                            ray.maxt = stream.maxt[i] = pi[i].t = t;
+                            pi[i].uv = Point2f(u, v);
+                            pi[i].f = idx;
+                            hits |= (uint64_t) 1 << i;
+                        }
+                    }
+                }
+            } else {
+                /* The rays are assumed to be coherent, so the direction of
+                   the first active one decides which child is visited first */
+                uint32_t first = 0;
+                while (!(active >> first & 1))
+                    ++first;
+
+                parent = Frame(bbox);
+                frames[stackSize] = parent;
+                masks[stackSize] = active;
+                if (rays[first].d[node.axis] < 0) {
+                    stack[stackSize++] = nodeIdx + 1;
+                    nodeIdx = node.offset;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    nodeIdx = nodeIdx + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+            break;
+        --stackSize;
+        nodeIdx = stack[stackSize];
+        active = masks[stackSize];
+        parent = frames[stackSize];
+    }
+
+    return hits;
+}
+
+template <typename Node>
+bool BVH::occludedTree(const std::vector<Node> &nodes, const Tree &tree, const Ray3f &ray) const {
+    const std::vector<Triangle4> &packets = tree.packets;
+    if (nodes.empty())
+        return false;
+
+    SlabRay sray(ray);
+    WatertightRay wray;
+    if (m_watertight)
+        wray = WatertightRay(ray);
+
+    /* Any hit terminates the query, so the children are visited in storage order */
+    typedef typename Node::Frame Frame;
+    uint32_t stack[MaxDepthLimit];
+    Frame frames[MaxDepthLimit];
+    uint32_t stackSize = 0;
+    uint32_t nodeIdx = 0;
+    Frame parent(tree.bbox);
+
+    while (true) {
+        const Node &node = nodes[nodeIdx];
+        const BoundingBox3f &bbox = node.getBoundingBox(parent);
+
+        if (bbox.rayIntersect(sray, ray.mint, ray.maxt)) {
+            if (node.isLeaf()) {
+                uint32_t packetEnd = node.offset + packetCount(node.count);
+                for (uint32_t i = node.offset; i < packetEnd; ++i) {
+                    float u, v, t;
+                    uint32_t idx;
+                    bool hit = m_watertight
+                        ? packets[i].rayIntersectWatertight(ray, wray, u, v, t, idx)
+                        : packets[i].rayIntersect(ray, u, v, t, idx);
+                    if (hit)
+                        return true;
+                }
+            } else {
+                parent = Frame(bbox);
+                frames[stackSize] = parent;
+                stack[stackSize++] = node.offset;
+                nodeIdx = nodeIdx + 1;
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+            break;
+        --stackSize;
+        nodeIdx = stack[stackSize];
+        parent = frames[stackSize];
+    }
+
+    return false;
+}
+
+NORI_REGISTER_CLASS(BVH, "bvh");
+NORI_NAMESPACE_END
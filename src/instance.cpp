@@ -0,0 +1,85 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/instance.h>
+#include <nori/bsdf.h>
+#include <filesystem/resolver.h>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &propList) {
+    filesystem::path path = getFileResolver()->resolve(propList.getString("filename"));
+    std::string filename = path.str();
+
+    /* The mesh plugins are named after the file extensions they load */
+    std::string type = path.extension();
+    if (type == "nmesh")
+        type = "binary";
+    else if (type != "obj" && type != "ply")
+        throw NoriException("Instance: unsupported mesh file \"%s\"!", filename);
+
+    /* Load every file only once and share it among all instances referring to it */
+    static std::map<std::string, std::weak_ptr<Mesh>> cache;
+    m_shape = cache[filename].lock();
+    if (!m_shape) {
+        PropertyList shapeProps;
+        shapeProps.setString("filename", filename);
+        m_shape.reset(static_cast<Mesh *>(
+            NoriObjectFactory::createInstance(type, shapeProps)));
+        m_shape->activate();
+        cache[filename] = m_shape;
+    }
+
+    m_toWorld = propList.getTransform("toWorld", Transform());
+    m_toObject = m_toWorld.inverse();
+    updateBoundingBox();
+
+    m_name = filename;
+}
+
+void Instance::updateBoundingBox() {
+    const BoundingBox3f &bbox = m_shape->getBoundingBox();
+    m_bbox.reset();
+    for (int i = 0; i < 8; ++i)
+        m_bbox.expandBy(m_toWorld * bbox.getCorner(i));
+}
+
+void Instance::addChild(NoriObject *obj) {
+    if (obj->getClassType() == EEmitter)
+        throw NoriException("Instance: area emitters are not supported!");
+    Mesh::addChild(obj);
+}
+
+std::string Instance::toString() const {
+    return tfm::format(
+        "Instance[\n"
+        "  name = \"%s\",\n"
+        "  triangleCount = %i,\n"
+        "  toWorld = %s,\n"
+        "  bsdf = %s\n"
+        "]",
+        m_name,
+        m_shape->getTriangleCount(),
+        indent(m_toWorld.toString(), 12),
+        m_bsdf ? indent(m_bsdf->toString()) : std::string("null")
+    );
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
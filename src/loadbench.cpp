@@ -0,0 +1,214 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Throughput benchmark for the mesh loaders
+ *
+ * Loads each of the given files (a comma-separated list in \c filenames)
+ * \c runs times with the plugin that matches its extension (\c obj,
+ * \c ply, or \c nmesh for the \c binary plugin) and reports the fastest
+ * and the median load time, along with the throughput in bytes and
+ * triangles per second. Since the loaders parse and deduplicate in
+ * parallel, every run must also produce exactly the same mesh, which is
+ * checked against the first run. If \c compare is set, the files must
+ * furthermore all contain the same mesh (e.g. in different formats), which
+ * is checked against the mesh loaded from the first file. If \c roundTrip
+ * is set, each mesh is also stored in Nori's binary mesh format (see
+ * \ref Mesh::saveBinary()) next to its file, and loading it back with the
+ * \c binary plugin must give exactly the same mesh.
+ */
+class LoadBenchmark : public NoriObject {
+public:
+    LoadBenchmark(const PropertyList &propList) {
+        /* Meshes that should be loaded */
+        m_filenames = tokenize(propList.getString("filenames"));
+
+        /* Number of times that each mesh is loaded (default: 5) */
+        m_runs = std::max(propList.getInteger("runs", 5), 1);
+
+        /* Must all files contain the same mesh? (default: false) */
+        m_compare = propList.getBoolean("compare", false);
+
+        /* Check that the meshes survive a round trip through the binary mesh format? (default: false) */
+        m_roundTrip = propList.getBoolean("roundTrip", false);
+    }
+
+    /// Run the benchmark on each of the provided meshes
+    void activate() {
+        int total = 0, passed = 0;
+        std::unique_ptr<Mesh> first;
+
+        for (const std::string &filename : m_filenames) {
+            filesystem::path path = getFileResolver()->resolve(filename);
+            std::string extension = path.extension();
+            std::string type = extension == "nmesh" ? "binary" : extension;
+            if (type != "obj" && type != "ply" && type != "binary")
+                throw NoriException("LoadBenchmark: unsupported mesh file \"%s\"!", filename);
+            size_t fileSize = MemoryMappedFile(path.str()).getSize();
+
+            cout << "------------------------------------------------------" << endl;
+            cout << "Benchmarking: \"" << filename << "\" (" << memString(fileSize) << ")" << endl;
+
+            PropertyList propList;
+            propList.setString("filename", filename);
+            std::unique_ptr<Mesh> reference;
+            std::vector<double> times;
+            bool consistent = true;
+            for (int i = 0; i < m_runs; ++i) {
+                Timer timer;
+                std::unique_ptr<Mesh> mesh(static_cast<Mesh *>(NoriObjectFactory::createInstance(type, propList)));
+                times.push_back(timer.elapsed());
+
+                if (!reference)
+                    reference = std::move(mesh);
+                else
+                    consistent &= isIdentical(reference.get(), mesh.get());
+            }
+
+            std::sort(times.begin(), times.end());
+            double fastest = std::max(times[0], 1.0), median = times[times.size() / 2];
+            cout << tfm::format("Loaded V=%i, F=%i: fastest %s, median %s (%s/s, %.2f Mtriangles/s)",
+                reference->getVertexCount(), reference->getTriangleCount(),
+                timeString(times[0]), timeString(median),
+                memString((size_t) (fileSize / (fastest * 1e-3))),
+                reference->getTriangleCount() / (1000.0 * fastest)) << endl;
+
+            ++total;
+            if (consistent)
+                ++passed;
+            else
+                cout << "The runs did not produce identical meshes!" << endl;
+
+            if (m_roundTrip) {
+                std::string binaryFilename = path.str() + ".roundtrip.nmesh";
+                reference->saveBinary(binaryFilename);
+                PropertyList binaryPropList;
+                binaryPropList.setString("filename", binaryFilename);
+                std::unique_ptr<Mesh> mesh;
+                try {
+                    mesh.reset(static_cast<Mesh *>(NoriObjectFactory::createInstance("binary", binaryPropList)));
+                } catch (...) {
+                    std::remove(binaryFilename.c_str());
+                    throw;
+                }
+                std::remove(binaryFilename.c_str());
+
+                ++total;
+                if (isIdentical(reference.get(), mesh.get()))
+                    ++passed;
+                else
+                    cout << "The mesh changed in a round trip through the binary mesh format!" << endl;
+            }
+
+            if (m_compare) {
+                if (!first) {
+                    first = std::move(reference);
+                } else {
+                    ++total;
+                    if (isEquivalent(first.get(), reference.get()))
+                        ++passed;
+                    else
+                        cout << tfm::format("The mesh differs from the one in \"%s\"!",
+                            m_filenames[0]) << endl;
+                }
+            }
+        }
+
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+        if (passed < total)
+            throw std::runtime_error("Some tests failed :(");
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "LoadBenchmark[\n"
+            "  filenames = \"%s\",\n"
+            "  runs = %i,\n"
+            "  compare = %s,\n"
+            "  roundTrip = %s\n"
+            "]",
+            join(m_filenames),
+            m_runs,
+            m_compare ? "true" : "false",
+            m_roundTrip ? "true" : "false"
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+
+protected:
+    /// Do the two matrices have exactly the same size and contents?
+    template <typename Matrix> static bool equal(const Matrix &m1, const Matrix &m2) {
+        return m1.rows() == m2.rows() && m1.cols() == m2.cols() &&
+               memcmp(m1.data(), m2.data(), m1.size() * sizeof(*m1.data())) == 0;
+    }
+
+    /// Do the two meshes have exactly the same vertices and triangles?
+    static bool isIdentical(const Mesh *a, const Mesh *b) {
+        return equal(a->getVertexPositions(), b->getVertexPositions()) &&
+               equal(a->getVertexNormals(), b->getVertexNormals()) &&
+               equal(a->getVertexTexCoords(), b->getVertexTexCoords()) &&
+               equal(a->getIndices(), b->getIndices());
+    }
+
+    /**
+     * \brief Do the two meshes, loaded from different files, have the same
+     * vertices and triangles?
+     *
+     * The loaders normalize the vertex normals, which only reproduces them
+     * up to rounding when the file already stores normalized ones, so
+     * normals are compared with a small tolerance.
+     */
+    static bool isEquivalent(const Mesh *a, const Mesh *b) {
+        const MatrixXf &N1 = a->getVertexNormals(), &N2 = b->getVertexNormals();
+        if (N1.rows() != N2.rows() || N1.cols() != N2.cols() ||
+            (N1.size() > 0 && (N1 - N2).cwiseAbs().maxCoeff() > 1e-6f))
+            return false;
+
+        return equal(a->getVertexPositions(), b->getVertexPositions()) &&
+               equal(a->getVertexTexCoords(), b->getVertexTexCoords()) &&
+               equal(a->getIndices(), b->getIndices());
+    }
+
+    /// Join a list of file names for \ref toString()
+    static std::string join(const std::vector<std::string> &strings) {
+        std::string result;
+        for (size_t i = 0; i < strings.size(); ++i)
+            result += (i > 0 ? ", " : "") + strings[i];
+        return result;
+    }
+
+private:
+    std::vector<std::string> m_filenames;
+    int m_runs;
+    bool m_compare;
+    bool m_roundTrip;
+};
+
+NORI_REGISTER_CLASS(LoadBenchmark, "loadbench");
+NORI_NAMESPACE_END
@@ -18,6 +18,7 @@
 
 #include <nori/parser.h>
 #include <nori/scene.h>
+#include <nori/mesh.h>
 #include <nori/camera.h>
 #include <nori/block.h>
 #include <nori/timer.h>
@@ -32,6 +33,49 @@
 
 using namespace nori;
 
+/* Render a block by tracing the camera rays in streams (see Integrator::usesRayStreams()) */
+static void renderBlockStreams(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+    const Camera *camera = scene->getCamera();
+    const Integrator *integrator = scene->getIntegrator();
+
+    Point2i offset = block.getOffset();
+    Vector2i size  = block.getSize();
+
+    const uint32_t streamSize = Accel::RayStreamSize;
+    Ray3f rays[streamSize];
+    Point2f pixelSamples[streamSize];
+    Color3f values[streamSize];
+    PreliminaryIntersection pi[streamSize];
+    uint32_t count = 0;
+
+    /* Trace the collected rays together and shade their intersections */
+    auto flush = [&]() {
+        scene->rayIntersect(count, rays, pi);
+        for (uint32_t j = 0; j < count; ++j) {
+            values[j] *= integrator->LiPrimary(scene, sampler, rays[j], pi[j]);
+            block.put(pixelSamples[j], values[j]);
+        }
+        count = 0;
+    };
+
+    /* Consecutive samples of neighboring pixels are coherent */
+    for (int y=0; y<size.y(); ++y) {
+        for (int x=0; x<size.x(); ++x) {
+            for (uint32_t i=0; i<sampler->getSampleCount(); ++i) {
+                Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+                Point2f apertureSample = sampler->next2D();
+
+                pixelSamples[count] = pixelSample;
+                values[count] = camera->sampleRay(rays[count], pixelSample, apertureSample);
+                if (++count == streamSize)
+                    flush();
+            }
+        }
+    }
+    if (count > 0)
+        flush();
+}
+
 static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
@@ -42,6 +86,11 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
+    if (integrator->usesRayStreams()) {
+        renderBlockStreams(scene, sampler, block);
+        return;
+    }
+
     /* For each pixel and pixel sample sample */
     for (int y=0; y<size.y(); ++y) {
         for (int x=0; x<size.x(); ++x) {
@@ -147,12 +196,48 @@ static void render(Scene *scene, const std::string &filename) {
     bitmap->savePNG(outputName);
 }
 
+/* Convert a mesh into Nori's binary mesh format (see Mesh::saveBinary()) */
+static void convertMesh(const std::string &input, std::string output) {
+    /* The mesh plugins are named after the file extensions they load */
+    std::string type = filesystem::path(input).extension();
+    if (type != "obj" && type != "ply")
+        throw NoriException("Unable to convert \"%s\": expected an OBJ or PLY file!", input);
+
+    if (output.empty()) {
+        output = input;
+        output.erase(output.find_last_of("."), std::string::npos);
+        output += ".nmesh";
+    }
+
+    PropertyList propList;
+    propList.setString("filename", input);
+    std::unique_ptr<Mesh> mesh(static_cast<Mesh *>(NoriObjectFactory::createInstance(type, propList)));
+
+    cout << "Writing \"" << output << "\" .. ";
+    cout.flush();
+    Timer timer;
+    mesh->saveBinary(output);
+    cout << "done. (took " << timer.elapsedString() << ")" << endl;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml>" << endl;
+    bool convert = (argc == 3 || argc == 4) && std::string(argv[1]) == "--convert";
+    if (argc != 2 && !convert) {
+        cerr << "Syntax: " << argv[0] << " <scene.xml>" << endl
+             << "        " << argv[0] << " --convert <mesh.obj|mesh.ply> [<mesh.nmesh>]" << endl;
         return -1;
     }
 
+    if (convert) {
+        try {
+            convertMesh(argv[2], argc == 4 ? argv[3] : "");
+        } catch (const std::exception &e) {
+            cerr << "Fatal error: " << e.what() << endl;
+            return -1;
+        }
+        return 0;
+    }
+
     filesystem::path path(argv[1]);
 
     try {
@@ -40,6 +40,26 @@ void Mesh::activate() {
     }
 }
 
+void Mesh::setVertexPositions(const MatrixXf &V, const MatrixXf &N) {
+    if (V.rows() != 3 || V.cols() != m_V.cols())
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertices, got %i!",
+                            m_V.cols(), V.cols());
+    if (N.size() > 0 && (N.rows() != 3 || N.cols() != m_V.cols()))
+        throw NoriException("Mesh::setVertexPositions(): expected %i normals, got %i!",
+                            m_V.cols(), N.cols());
+
+    m_V = V;
+    if (N.size() > 0)
+        m_N = N;
+    updateBoundingBox();
+}
+
+void Mesh::updateBoundingBox() {
+    m_bbox.reset();
+    for (int i = 0; i < m_V.cols(); ++i)
+        m_bbox.expandBy(m_V.col(i));
+}
+
 float Mesh::surfaceArea(uint32_t index) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
 
@@ -87,6 +107,55 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
     return t >= ray.mint && t <= ray.maxt;
 }
 
+bool Mesh::rayIntersectWatertight(uint32_t index, const Ray3f &ray, const WatertightRay &wray,
+                                  float &u, float &v, float &t) const {
+    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    return wray.intersect(ray, m_V.col(i0), m_V.col(i1), m_V.col(i2), u, v, t);
+}
+
+bool WatertightRay::intersect(const Ray3f &ray, const Point3f &p0, const Point3f &p1,
+                              const Point3f &p2, float &u, float &v, float &t) const {
+    /* Vertices relative to the ray origin */
+    Vector3f A = p0 - ray.o, B = p1 - ray.o, C = p2 - ray.o;
+
+    /* Shear and scale the vertices so that the ray points along +Z */
+    float Ax = A[kx] - Sx * A[kz], Ay = A[ky] - Sy * A[kz];
+    float Bx = B[kx] - Sx * B[kz], By = B[ky] - Sy * B[kz];
+    float Cx = C[kx] - Sx * C[kz], Cy = C[ky] - Sy * C[kz];
+
+    /* Scaled barycentric coordinates (2D edge functions) */
+    float U = Cx * By - Cy * Bx;
+    float V = Ax * Cy - Ay * Cx;
+    float W = Bx * Ay - By * Ax;
+
+    /* Fall back to double precision when the ray passes exactly through an edge */
+    if (U == 0.0f || V == 0.0f || W == 0.0f) {
+        U = (float) ((double) Cx * (double) By - (double) Cy * (double) Bx);
+        V = (float) ((double) Ax * (double) Cy - (double) Ay * (double) Cx);
+        W = (float) ((double) Bx * (double) Ay - (double) By * (double) Ax);
+    }
+
+    /* The ray hits the triangle iff the edge functions agree in sign */
+    if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0))
+        return false;
+
+    float det = U + V + W;
+    if (det == 0.0f)
+        return false;
+
+    /* Scaled hit distance */
+    float T = Sz * (U * A[kz] + V * B[kz] + W * C[kz]);
+
+    float invDet = 1.0f / det;
+    t = T * invDet;
+    if (!(t >= ray.mint && t <= ray.maxt))
+        return false;
+
+    u = V * invDet;
+    v = W * invDet;
+    return true;
+}
+
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
     BoundingBox3f result(m_V.col(m_F(0, index)));
     result.expandBy(m_V.col(m_F(1, index)));
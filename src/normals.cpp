@@ -21,6 +21,21 @@ class NormalIntegrator : public Integrator {
         Normal3f n = its.shFrame.n.cwiseAbs();
         return Color3f(n.x(), n.y(), n.z());
     }
+
+    Color3f LiPrimary(const Scene* scene, Sampler* /* sampler */, const Ray3f& /* ray */,
+                      const PreliminaryIntersection& pi) const
+    {
+        if (!pi.mesh)
+            return Color3f(0.0f);
+
+        Intersection its;
+        scene->computeIntersection(pi, its);
+        Normal3f n = its.shFrame.n.cwiseAbs();
+        return Color3f(n.x(), n.y(), n.z());
+    }
+
+    /* Camera rays are traced in streams */
+    bool usesRayStreams() const { return true; }
     std::string toString() const
     {
 //        return tfm::format(
@@ -17,115 +17,136 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/textparser.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <atomic>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory-mapped and split into line-aligned chunks, which are
+ * parsed in parallel by \ref TextParser. Polygons with more than three
+ * vertices are split into a triangle fan. The chunks are then merged and
+ * their face vertices deduplicated in parallel (see \ref deduplicate()),
+ * which yields exactly the same mesh as parsing the file in one go.
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
 
-        std::ifstream is(filename.str());
-        if (is.fail())
-            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
+        MemoryMappedFile file(filename.str());
         Transform trafo = propList.getTransform("toWorld", Transform());
 
         cout << "Loading \"" << filename << "\" .. ";
         cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
+        /* Split the file into chunks that end after a line break */
+        const char *data = (const char *) file.getData();
+        const char *dataEnd = data + file.getSize();
+        std::vector<const char *> bounds = { data };
+        for (size_t offset = ChunkSize; offset < file.getSize(); offset += ChunkSize) {
+            const char *ptr = std::max(data + offset, bounds.back());
+            const char *newline = (const char *) memchr(ptr, '\n', (size_t) (dataEnd - ptr));
+            if (!newline)
+                break;
+            bounds.push_back(newline + 1);
+        }
+        bounds.push_back(dataEnd);
 
-            std::string prefix;
-            line >> prefix;
+        std::vector<OBJChunk> chunks(bounds.size() - 1);
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            parseChunk(bounds[i], bounds[i + 1], trafo, chunks[i]);
+        });
 
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
+        /* Report the first error in the file */
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            const OBJChunk &chunk = chunks[i];
+            if (chunk.error) {
+                uint32_t line = chunk.errorLine + (uint32_t) std::count(data, bounds[i], '\n');
+                throw NoriException("%s in line %i of \"%s\"!", chunk.error, line, filename);
             }
         }
 
+        /* Concatenate the chunks */
+        std::vector<size_t> offsets(4 * (chunks.size() + 1), 0);
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            const OBJChunk &chunk = chunks[i];
+            size_t *offset = &offsets[4 * i], *next = &offsets[4 * (i + 1)];
+            next[0] = offset[0] + chunk.positions.size();
+            next[1] = offset[1] + chunk.texcoords.size();
+            next[2] = offset[2] + chunk.normals.size();
+            next[3] = offset[3] + chunk.corners.size();
+            m_bbox.expandBy(chunk.bbox);
+        }
+
+        const size_t *totals = &offsets[4 * chunks.size()];
+        std::vector<Vector3f>   positions(totals[0]);
+        std::vector<Vector2f>   texcoords(totals[1]);
+        std::vector<Vector3f>   normals(totals[2]);
+        std::vector<OBJVertex>  corners(totals[3]);
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            OBJChunk &chunk = chunks[i];
+            const size_t *offset = &offsets[4 * i];
+            std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + offset[0]);
+            std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), texcoords.begin() + offset[1]);
+            std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + offset[2]);
+            std::copy(chunk.corners.begin(), chunk.corners.end(), corners.begin() + offset[3]);
+            chunk = OBJChunk();
+        });
+
+        /* Convert to an indexed vertex list */
+        std::vector<uint32_t>   indices;
+        std::vector<OBJVertex>  vertices;
+        deduplicate(corners, (uint32_t) positions.size(), indices, vertices);
+        std::vector<OBJVertex>().swap(corners);
+
         m_F.resize(3, indices.size()/3);
         memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
-
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
-        }
+        uint32_t vertexCount = (uint32_t) vertices.size();
+        m_V.resize(3, vertexCount);
+        if (!normals.empty())
+            m_N.resize(3, vertexCount);
+        if (!texcoords.empty())
+            m_UV.resize(2, vertexCount);
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
-        }
+        std::atomic<bool> invalid(false);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, vertexCount),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i < range.end(); ++i) {
+                    /* Missing (zero) indices wrap around and fail the checks */
+                    const OBJVertex &v = vertices[i];
+                    if (v.p - 1 >= positions.size() ||
+                        (!normals.empty() && v.n - 1 >= normals.size()) ||
+                        (!texcoords.empty() && v.uv - 1 >= texcoords.size())) {
+                        invalid = true;
+                        continue;
+                    }
+                    m_V.col(i) = positions[v.p - 1];
+                    if (!normals.empty())
+                        m_N.col(i) = normals[v.n - 1];
+                    if (!texcoords.empty())
+                        m_UV.col(i) = texcoords[v.uv - 1];
+                }
+            }
+        );
+        if (invalid)
+            throw NoriException("\"%s\" references a vertex attribute that does not exist!", filename);
 
         m_name = filename.str();
+        double elapsed = timer.elapsed();
         cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
+             << timeString(elapsed) << " at "
+             << memString((size_t) (file.getSize() / (std::max(elapsed, 1.0) * 1e-3))) << "/s and "
              << memString(m_F.size() * sizeof(uint32_t) +
                           sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
              << ")" << endl;
@@ -140,35 +161,266 @@ protected:
 
         inline OBJVertex() { }
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+        inline bool operator==(const OBJVertex &v) const {
+            return v.p == p && v.n == n && v.uv == uv;
+        }
+    };
+
+    /// Contents of a line-aligned chunk of the file
+    struct OBJChunk {
+        std::vector<Vector3f>  positions;
+        std::vector<Vector2f>  texcoords;
+        std::vector<Vector3f>  normals;
+        std::vector<OBJVertex> corners;   ///< Face vertices, three per triangle
+        BoundingBox3f bbox;               ///< Bounding box of the positions
+        const char *error = nullptr;      ///< Description of the first parse error
+        uint32_t errorLine = 0;           ///< Line of the error within the chunk (starting at 1)
+    };
+
+    /// Parse the lines in <tt>[begin, end)</tt>, stopping at the first error
+    static void parseChunk(const char *begin, const char *end, const Transform &trafo, OBJChunk &chunk) {
+        TextParser parser(begin, end);
+        auto fail = [&](const char *error) {
+            chunk.error = error;
+            chunk.errorLine = parser.getLine();
+        };
+
+        while (!parser.atEnd()) {
+            parser.skipSpaces();
+
+            if (parser.consumeKeyword("v")) {
+                Point3f p;
+                if (!parser.parseFloat(p.x()) || !parser.parseFloat(p.y()) || !parser.parseFloat(p.z()))
+                    return fail("Invalid vertex position");
+                p = trafo * p;
+                chunk.bbox.expandBy(p);
+                chunk.positions.push_back(p);
+            } else if (parser.consumeKeyword("vt")) {
+                Point2f tc;
+                if (!parser.parseFloat(tc.x()) || !parser.parseFloat(tc.y()))
+                    return fail("Invalid texture coordinates");
+                chunk.texcoords.push_back(tc);
+            } else if (parser.consumeKeyword("vn")) {
+                Normal3f n;
+                if (!parser.parseFloat(n.x()) || !parser.parseFloat(n.y()) || !parser.parseFloat(n.z()))
+                    return fail("Invalid normal");
+                chunk.normals.push_back((trafo * n).normalized());
+            } else if (parser.consumeKeyword("f")) {
+                /* Vertex i > 2 adds the triangle (i, 0, i - 1) */
+                OBJVertex first, previous;
+                uint32_t count = 0;
+                for (parser.skipSpaces(); !parser.atEndOfLine(); parser.skipSpaces()) {
+                    OBJVertex v;
+                    if (!parseVertex(parser, v))
+                        return fail("Invalid vertex data");
+                    chunk.corners.push_back(v);
+                    if (count >= 3) {
+                        chunk.corners.push_back(first);
+                        chunk.corners.push_back(previous);
+                    }
+                    if (count == 0)
+                        first = v;
+                    previous = v;
+                    ++count;
+                }
+                if (count < 3)
+                    return fail("Face with less than three vertices");
+            }
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+            parser.skipLine();
+        }
+    }
 
-            p = toUInt(tokens[0]);
+    /// Parse a face vertex of the form <tt>p</tt>, <tt>p/uv</tt>, <tt>p//n</tt> or <tt>p/uv/n</tt>
+    static bool parseVertex(TextParser &parser, OBJVertex &v) {
+        if (!parser.parseUInt(v.p))
+            return false;
+        if (!parser.consume('/'))
+            return true;
+        if (!parser.consume('/')) {
+            if (!parser.parseUInt(v.uv))
+                return false;
+            if (!parser.consume('/'))
+                return true;
+        }
+        return parser.parseUInt(v.n);
+    }
+
+    /**
+     * \brief Merge identical face vertices into an indexed vertex list
+     *
+     * Distinct vertices are numbered in the order of their first occurrence
+     * in \c corners, as a sequential pass over a single hash map would. The
+     * corners are distributed over \ref PartitionCount partitions by their
+     * position index (keeping their order within each partition), so that
+     * each partition can find the first occurrences of its vertices with a
+     * \ref VertexMap of its own. A prefix sum over the first occurrences then
+     * yields the final numbering.
+     *
+     * Splitting the range of position indices rather than hashing keeps
+     * the corners of each partition close together in typical files,
+     * whose faces reference nearby vertices.
+     */
+    static void deduplicate(const std::vector<OBJVertex> &corners, uint32_t positionCount,
+                            std::vector<uint32_t> &indices, std::vector<OBJVertex> &vertices) {
+        uint32_t count = (uint32_t) corners.size();
+        uint32_t blockCount = (count + BlockSize - 1) / BlockSize;
+        uint64_t partitionSize = std::max(((uint64_t) positionCount + PartitionCount - 1) / PartitionCount, (uint64_t) 1);
+        auto partition = [&](const OBJVertex &v) {
+            /* Invalid indices end up in the last partition */
+            return (uint32_t) std::min((uint64_t) (v.p - 1) / partitionSize, (uint64_t) PartitionCount - 1);
+        };
+        auto forEachBlock = [&](const auto &func) {
+            tbb::parallel_for(uint32_t(0), blockCount, [&](uint32_t block) {
+                func(block, block * BlockSize, std::min(count, (block + 1) * BlockSize));
+            });
+        };
+
+        /* Counting sort of the corners by partition. Entry 'partition * blockCount + block'
+           of 'offsets' holds the start of the corners of a block within a partition */
+        std::vector<uint32_t> offsets((size_t) PartitionCount * blockCount + 1, 0);
+        forEachBlock([&](uint32_t block, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i)
+                offsets[(size_t) partition(corners[i]) * blockCount + block + 1]++;
+        });
+        for (size_t i = 1; i < offsets.size(); ++i)
+            offsets[i] += offsets[i - 1];
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+        std::vector<uint32_t> order(count);
+        forEachBlock([&](uint32_t block, uint32_t begin, uint32_t end) {
+            uint32_t cursor[PartitionCount];
+            for (uint32_t j = 0; j < PartitionCount; ++j)
+                cursor[j] = offsets[(size_t) j * blockCount + block];
+            for (uint32_t i = begin; i < end; ++i)
+                order[cursor[partition(corners[i])]++] = i;
+        });
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+        /* Index of the first corner with the same vertex */
+        std::vector<uint32_t> first(count);
+        tbb::parallel_for(uint32_t(0), PartitionCount, [&](uint32_t j) {
+            uint32_t begin = offsets[(size_t) j * blockCount], end = offsets[(size_t) (j + 1) * blockCount];
+            VertexMap vertexMap(end - begin);
+            for (uint32_t k = begin; k < end; ++k) {
+                uint32_t i = order[k];
+                first[i] = vertexMap.insert(corners[i], i);
+            }
+        });
+        std::vector<uint32_t>().swap(order);
+
+        /* Number the first occurrences in order */
+        std::vector<uint32_t> blockOffsets(blockCount + 1, 0);
+        forEachBlock([&](uint32_t block, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; ++i)
+                blockOffsets[block + 1] += first[i] == i;
+        });
+        for (uint32_t block = 0; block < blockCount; ++block)
+            blockOffsets[block + 1] += blockOffsets[block];
+
+        indices.resize(count);
+        vertices.resize(blockOffsets[blockCount]);
+        forEachBlock([&](uint32_t block, uint32_t begin, uint32_t end) {
+            uint32_t index = blockOffsets[block];
+            for (uint32_t i = begin; i < end; ++i) {
+                if (first[i] == i) {
+                    vertices[index] = corners[i];
+                    indices[i] = index++;
+                }
+            }
+        });
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, count),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i < range.end(); ++i)
+                    indices[i] = indices[first[i]];
+            }
+        );
+    }
+
+    /**
+     * \brief Hash map from face vertices to the index of their first corner
+     *
+     * Uses open addressing with linear probing in a power-of-two table that
+     * stores the vertices inline, so that a lookup usually touches a single
+     * cache line instead of following the node pointers of a
+     * \c std::unordered_map. The table is sized up front from the number of
+     * corners and doubles whenever it becomes half full.
+     */
+    class VertexMap {
+    public:
+        /// Create a map for the vertices of \c cornerCount corners
+        VertexMap(uint32_t cornerCount) {
+            /* Closed triangle meshes have about twice as many faces as
+               vertices, i.e. six corners per vertex. One slot per two corners
+               stays below half full even if seams add 50% more vertices */
+            size_t capacity = 16;
+            while (capacity < cornerCount / 2)
+                capacity *= 2;
+            m_slots.resize(capacity);
         }
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
+        /**
+         * \brief Insert a vertex unless it is already present
+         *
+         * \return The index of the first corner with this vertex (i.e.
+         * \c index if it was inserted)
+         */
+        uint32_t insert(const OBJVertex &v, uint32_t index) {
+            if (2 * (m_size + 1) > m_slots.size())
+                grow();
+            size_t mask = m_slots.size() - 1;
+            for (size_t i = hash(v) & mask; ; i = (i + 1) & mask) {
+                Slot &slot = m_slots[i];
+                if (slot.index == Empty) {
+                    slot.vertex = v;
+                    slot.index = index;
+                    ++m_size;
+                    return index;
+                } else if (slot.vertex == v) {
+                    return slot.index;
+                }
+            }
+        }
+
+    private:
+        struct Slot {
+            OBJVertex vertex;
+            uint32_t index = Empty;
+        };
+
+        /// Marks unused slots
+        static const uint32_t Empty = (uint32_t) -1;
+
+        /// Mix the three indices, using the finalizer of MurmurHash3 for the avalanche
+        static size_t hash(const OBJVertex &v) {
+            uint64_t h = (((uint64_t) v.p << 32) | v.n) ^ ((uint64_t) v.uv * 0x9E3779B97F4A7C15ull);
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDull;
+            h ^= h >> 33;
+            h *= 0xC4CEB9FE1A85EC53ull;
+            h ^= h >> 33;
+            return (size_t) h;
         }
-    };
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash : std::unary_function<OBJVertex, size_t> {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+        /// Double the size of the table
+        void grow() {
+            std::vector<Slot> slots(2 * m_slots.size());
+            slots.swap(m_slots);
+            m_size = 0;
+            for (const Slot &slot : slots) {
+                if (slot.index != Empty)
+                    insert(slot.vertex, slot.index);
+            }
         }
+
+        std::vector<Slot> m_slots;
+        size_t m_size = 0;
     };
+
+    /// Size of the chunks of the file that are parsed in parallel
+    static const size_t ChunkSize = 1 << 20;
+    /// Number of corners per task of \ref deduplicate()
+    static const uint32_t BlockSize = 1 << 16;
+    /// Number of partitions of the corners in \ref deduplicate()
+    static const uint32_t PartitionCount = 64;
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
@@ -0,0 +1,755 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/octreenode.h>
+#include <nori/leaftriangle.h>
+#include <nori/timer.h>
+#include <atomic>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#if defined(NORI_SSE)
+#include <xmmintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Octree acceleration data structure
+ *
+ * Recursively splits the bounding box of the mesh into eight equally sized
+ * children. Triangles are clipped against the children and referenced by
+ * every child that they actually intersect. Nodes are only split when
+ * that reduces the expected cost of a ray query, which keeps large
+ * triangles from being duplicated into a huge number of leaves. A separate
+ * octree is built for each shape, and its nodes are stored in the linear
+ * layout described in \ref OctreeNode.
+ *
+ * The build can be tuned with the following properties:
+ * - \c traversalCost: cost of visiting an interior node relative to a
+ *   triangle test (default: 8)
+ * - \c intersectionCost: cost of a ray-triangle test (default: 1)
+ * - \c maxDepth: maximum number of subdivisions below the root (default: 16,
+ *   at most 16)
+ *
+ * The \c leafFormat property selects how the leaves store their triangles:
+ * - \c indexed: triangle indices, which are looked up in the mesh (default)
+ * - \c vertices: copies of the vertex positions (see \ref LeafTriangle)
+ * - \c affine: precomputed maps into the barycentric coordinate system of
+ *   each triangle (see \ref AffineTriangle), which cannot be combined with
+ *   the watertight test
+ *
+ * The latter two avoid the indirection through the mesh, but need 10 and
+ * 13 times as much leaf memory.
+ *
+ * Since the subdivision depends on the vertex positions, \ref refit()
+ * rebuilds the octrees from scratch.
+ */
+class Octree : public Accel {
+public:
+    Octree(const PropertyList &propList) : Accel(propList)
+    {
+        m_traversal_cost = propList.getFloat("traversalCost", 8.0f);
+        m_intersection_cost = propList.getFloat("intersectionCost", 1.0f);
+        m_max_depth = propList.getInteger("maxDepth", (int) MAX_DEPTH_LIMIT);
+
+        std::string leaf_format = propList.getString("leafFormat", "indexed");
+        if(leaf_format == "indexed")
+            m_leaf_format = EIndexed;
+        else if(leaf_format == "vertices")
+            m_leaf_format = EVertices;
+        else if(leaf_format == "affine")
+            m_leaf_format = EAffine;
+        else
+            throw NoriException("Octree: unknown leaf format '%s'!", leaf_format);
+
+        if(m_max_depth < 1 || m_max_depth > MAX_DEPTH_LIMIT)
+            throw NoriException("Octree: 'maxDepth' must be between 1 and %i!", (int) MAX_DEPTH_LIMIT);
+        if(!(m_traversal_cost >= 0) || !(m_intersection_cost > 0))
+            throw NoriException("Octree: the traversal and intersection costs must be positive!");
+        if(m_leaf_format == EAffine && m_watertight)
+            throw NoriException("Octree: the 'affine' leaf format does not support the watertight test!");
+    }
+
+    void build() {
+        m_trees.clear();
+        m_trees.resize(m_shapes.size());
+
+        cout << "Building octree .. ";
+        cout.flush();
+        Timer timer;
+
+        /* The shapes are built concurrently, and so are the children of large
+           nodes. Shapes that were built by a previous run are read from the cache */
+        std::atomic<uint32_t> cached_count(0);
+        std::string description = toString();
+        tbb::parallel_for(size_t(0), m_shapes.size(), [&](size_t i)
+        {
+            Tree& tree = m_trees[i];
+            bool cached = m_cache.load(m_shapes[i], description, [&](AccelCache::Reader& reader)
+            {
+                return reader.read(tree.nodes) && reader.read(tree.indices) && reader.read(tree.triangles) &&
+                       reader.read(tree.affine_triangles) && reader.read(tree.stats);
+            });
+
+            if(cached)
+            {
+                ++cached_count;
+            }
+            else
+            {
+                buildTree(m_shapes[i], tree);
+                m_cache.save(m_shapes[i], description, [&](AccelCache::Writer& writer)
+                {
+                    writer.write(tree.nodes);
+                    writer.write(tree.indices);
+                    writer.write(tree.triangles);
+                    writer.write(tree.affine_triangles);
+                    writer.write(tree.stats);
+                });
+            }
+        });
+        buildTopLevel();
+
+        BuildStatistics stats;
+        size_t node_count = 0, leaf_memory = 0;
+        for(size_t i = 0; i < m_trees.size(); ++i)
+        {
+            const Tree& tree = m_trees[i];
+            stats.merge(tree.stats);
+            node_count += tree.nodes.size();
+            leaf_memory += tree.indices.size() * sizeof(uint32_t) +
+                           tree.triangles.size() * sizeof(LeafTriangle) +
+                           tree.affine_triangles.size() * sizeof(AffineTriangle);
+        }
+
+        m_cachedCount = cached_count;
+        printBuildReport(stats, cached_count, node_count * sizeof(OctreeNode),
+                         leaf_memory, timer.elapsed());
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "Octree[\n"
+            "  traversalCost = %.2f,\n"
+            "  intersectionCost = %.2f,\n"
+            "  maxDepth = %i,\n"
+            "  leafFormat = %s,\n"
+            "  watertight = %s\n"
+            "]",
+            m_traversal_cost,
+            m_intersection_cost,
+            m_max_depth,
+            m_leaf_format == EIndexed ? "indexed" : (m_leaf_format == EVertices ? "vertices" : "affine"),
+            m_watertight ? "true" : "false"
+        );
+    }
+
+protected:
+    /// Storage of the triangles referenced by the leaves
+    enum ELeafFormat
+    {
+        EIndexed = 0,
+        EVertices,
+        EAffine
+    };
+
+    /**
+     * \brief Octree (or subtree) in the linear layout, its root is the first node
+     *
+     * The leaves reference a range of \c indices during the build. Afterwards,
+     * the indices are replaced by the array of the selected leaf format,
+     * which holds the triangles in the same order.
+     */
+    struct Tree {
+        std::vector<OctreeNode>     nodes;            ///< Nodes in the linear layout
+        std::vector<uint32_t>       indices;          ///< Triangle indices referenced by the leaves
+        std::vector<LeafTriangle>   triangles;        ///< Copies of the referenced triangles ('vertices' format)
+        std::vector<AffineTriangle> affine_triangles; ///< Maps of the referenced triangles ('affine' format)
+        BuildStatistics             stats;            ///< Statistics collected during the build
+    };
+
+    /// Reference to a triangle along with the bounds of its part inside the current node
+    struct Reference {
+        uint32_t tri;
+        BoundingBox3f bbox;
+    };
+
+    /// Build the octree over the triangles of the given mesh
+    void buildTree(const Mesh* mesh, Tree& tree) const
+    {
+        uint32_t tri_count = mesh->getTriangleCount();
+        if(tri_count == 0)
+            return;
+
+        std::vector<Reference> refs(tri_count);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, tri_count),
+            [&](const tbb::blocked_range<uint32_t>& range)
+            {
+                for(uint32_t i = range.begin(); i < range.end(); ++i)
+                    refs[i] = { i, mesh->getBoundingBox(i) };
+            }
+        );
+
+        tree.nodes.push_back(OctreeNode::leaf(0, 0));
+        build(mesh, 0, mesh->getBoundingBox(), refs, 0, tree);
+        tree.nodes.shrink_to_fit();
+        tree.indices.shrink_to_fit();
+
+        if(m_leaf_format == EIndexed)
+            return;
+
+        /* Replace the indices by the triangle data, leaving the offsets of the leaves unchanged */
+        size_t ref_count = tree.indices.size();
+        if(m_leaf_format == EVertices)
+            tree.triangles.resize(ref_count);
+        else
+            tree.affine_triangles.resize(ref_count);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, ref_count),
+            [&](const tbb::blocked_range<size_t>& range)
+            {
+                for(size_t j = range.begin(); j < range.end(); ++j)
+                {
+                    if(m_leaf_format == EVertices)
+                        tree.triangles[j] = LeafTriangle(mesh, tree.indices[j]);
+                    else
+                        tree.affine_triangles[j] = AffineTriangle(mesh, tree.indices[j]);
+                }
+            }
+        );
+        std::vector<uint32_t>().swap(tree.indices);
+    }
+
+    /**
+     * \brief Clip a triangle against a box
+     *
+     * Computes the bounding box of the part of the triangle \c f that lies
+     * inside of \c bbox (Sutherland-Hodgman clipping), which is much tighter
+     * than the overlap of the bounding boxes for large triangles.
+     *
+     * \return \c false if the triangle does not intersect the box
+     */
+    static bool clipTriangle(const Mesh* mesh, uint32_t f, const BoundingBox3f& bbox, BoundingBox3f& result)
+    {
+        const MatrixXf& V = mesh->getVertexPositions();
+        const MatrixXu& F = mesh->getIndices();
+
+        /* Every clip plane adds at most one vertex to the polygon */
+        Point3f poly[9], clipped[9];
+        int count = 3;
+        for(int i = 0; i < 3; ++i)
+            poly[i] = V.col(F(i, f));
+
+        for(int k = 0; k < 3 && count > 0; ++k)
+        {
+            for(int side = 0; side < 2 && count > 0; ++side)
+            {
+                /* Keep the part with sign * (p[k] - plane) >= 0 */
+                float plane = side ? bbox.max[k] : bbox.min[k];
+                float sign = side ? -1.0f : 1.0f;
+                int clipped_count = 0;
+                for(int i = 0; i < count; ++i)
+                {
+                    const Point3f& p0 = poly[i];
+                    const Point3f& p1 = poly[(i + 1) % count];
+                    float d0 = sign * (p0[k] - plane), d1 = sign * (p1[k] - plane);
+                    if(d0 >= 0)
+                        clipped[clipped_count++] = p0;
+                    if((d0 < 0 && d1 > 0) || (d0 > 0 && d1 < 0))
+                    {
+                        Point3f p = p0 + (d0 / (d0 - d1)) * (p1 - p0);
+                        p[k] = plane;
+                        clipped[clipped_count++] = p;
+                    }
+                }
+                count = clipped_count;
+                std::copy(clipped, clipped + count, poly);
+            }
+        }
+
+        if(count == 0)
+            return false;
+
+        result.reset();
+        for(int i = 0; i < count; ++i)
+            result.expandBy(poly[i]);
+        result.clip(bbox);
+        return true;
+    }
+
+    /**
+     * \brief Recursively build the subtree rooted at the node \c node_idx
+     *
+     * The node must already have been allocated in \c tree. A triangle is
+     * passed on to every child that its clipped part intersects. The node
+     * is split when the expected cost of the split (see \ref m_traversal_cost)
+     * is lower than that of intersecting all of its triangles, so that
+     * large triangles, which end up in all children, stop the subdivision.
+     *
+     * Non-empty children are appended to \c tree as one contiguous block
+     * before descending into them. Nodes with many triangles build the
+     * subtrees of their children in parallel and then append them one after
+     * the other, which yields the same layout as a serial build.
+     */
+    void build(const Mesh* mesh, uint32_t node_idx, const BoundingBox3f& bbox, std::vector<Reference>& refs,
+               int depth, Tree& tree) const
+    {
+        std::vector<OctreeNode>& nodes = tree.nodes;
+        std::vector<uint32_t>& indices = tree.indices;
+        BuildStatistics& stats = tree.stats;
+
+        /* Probability that a ray through the root also visits this node */
+        float area_ratio = bbox.getSurfaceArea() / mesh->getBoundingBox().getSurfaceArea();
+
+        float leaf_cost = m_intersection_cost * refs.size();
+        auto make_leaf = [&]()
+        {
+            if(refs.size() > MAX_LEAF_SIZE)
+                throw NoriException("Octree: a leaf has %i triangles, but at most %i are supported!",
+                                    refs.size(), (int) MAX_LEAF_SIZE);
+            nodes[node_idx] = OctreeNode::leaf((uint32_t) indices.size(), (uint32_t) refs.size());
+            for(const Reference& ref : refs)
+                indices.push_back(ref.tri);
+            stats.addLeaf(depth + 1, (uint32_t) refs.size(), leaf_cost * area_ratio);
+        };
+
+        /* The split cost below is the traversal cost plus a non-negative term,
+           so a node whose leaf cost does not exceed the traversal cost always
+           becomes a leaf. Deciding this before classifying the triangles gives
+           exactly the same tree, but saves the work for all small nodes. */
+        if(depth >= m_max_depth || leaf_cost <= m_traversal_cost)
+        {
+            make_leaf();
+            return;
+        }
+
+        bool parallel = refs.size() >= PARALLEL_THRESHOLD;
+        std::vector<Reference> child_refs[8];
+        BoundingBox3f sub_bbox[8];
+        calSubBox(bbox, sub_bbox);
+
+        /* Triangles are clipped against the children slightly enlarged,
+           so that rounding errors never lose one of them */
+        float eps = 1e-5f * bbox.getExtents().maxCoeff();
+
+        auto classify = [&](int j)
+        {
+            BoundingBox3f child_bbox(sub_bbox[j].min - Vector3f::Constant(eps),
+                                     sub_bbox[j].max + Vector3f::Constant(eps));
+            for(const Reference& ref : refs)
+            {
+                if(!child_bbox.overlaps(ref.bbox))
+                    continue;
+                Reference child_ref = { ref.tri, ref.bbox };
+                if(child_bbox.contains(ref.bbox) || clipTriangle(mesh, ref.tri, child_bbox, child_ref.bbox))
+                {
+                    child_ref.bbox.clip(child_bbox);
+                    child_refs[j].push_back(child_ref);
+                }
+            }
+        };
+        if(parallel)
+            tbb::parallel_for(0, 8, classify);
+        else
+            for(int j = 0; j < 8; ++j)
+                classify(j);
+
+        /* Each child covers a quarter of the surface area of the node, which
+           is the probability that a ray through the node also visits it */
+        size_t child_ref_count = 0;
+        for(int i = 0; i < 8; ++i)
+            child_ref_count += child_refs[i].size();
+        float split_cost = m_traversal_cost + m_intersection_cost * 0.25f * child_ref_count;
+        if(split_cost >= leaf_cost)
+        {
+            make_leaf();
+            return;
+        }
+
+        /* The reference list of this node is no longer needed */
+        std::vector<Reference>().swap(refs);
+
+        uint32_t child_mask = 0;
+        for(int i = 0; i < 8; ++i)
+        {
+            if(!child_refs[i].empty())
+                child_mask |= 1u << i;
+        }
+
+        uint32_t first_child = (uint32_t) nodes.size();
+        nodes[node_idx] = OctreeNode::interior(first_child, child_mask);
+        nodes.resize(nodes.size() + popcount(child_mask), OctreeNode::leaf(0, 0));
+        stats.addInterior(m_traversal_cost * area_ratio);
+
+        if(!parallel)
+        {
+            uint32_t child_idx = first_child;
+            for(int i = 0; i < 8; ++i)
+            {
+                if(child_mask & (1u << i))
+                    build(mesh, child_idx++, sub_bbox[i], child_refs[i], depth + 1, tree);
+            }
+            return;
+        }
+
+        Tree subtrees[8];
+        tbb::parallel_for(0, 8, [&](int i)
+        {
+            if(!(child_mask & (1u << i)))
+                return;
+            subtrees[i].nodes.push_back(OctreeNode::leaf(0, 0));
+            build(mesh, 0, sub_bbox[i], child_refs[i], depth + 1, subtrees[i]);
+        });
+
+        /* Append the subtrees, relocating their node and index offsets */
+        uint32_t child_idx = first_child;
+        for(int i = 0; i < 8; ++i)
+        {
+            if(!(child_mask & (1u << i)))
+                continue;
+            const Tree& subtree = subtrees[i];
+            uint32_t node_base = (uint32_t) nodes.size() - 1;
+            uint32_t index_base = (uint32_t) indices.size();
+            for(size_t j = 0; j < subtree.nodes.size(); ++j)
+            {
+                OctreeNode node = subtree.nodes[j];
+                node.offset += node.isLeaf() ? index_base : node_base;
+                if(j == 0)
+                    nodes[child_idx++] = node;
+                else
+                    nodes.push_back(node);
+            }
+            indices.insert(indices.end(), subtree.indices.begin(), subtree.indices.end());
+            stats.merge(subtree.stats);
+        }
+    }
+
+    bool rayIntersectShape(uint32_t shapeIdx, Ray3f& ray, PreliminaryIntersection& pi) const;
+
+    bool occludedShape(uint32_t shapeIdx, const Ray3f& ray) const;
+
+    /**
+     * \brief Intersect a ray against the triangles of a leaf
+     *
+     * Every intersection that is found shrinks <tt>ray.maxt</tt> and is
+     * recorded in \c pi. Shadow rays return at the first one instead.
+     *
+     * \return \c true if an intersection was found
+     */
+    bool intersectLeaf(const Mesh* mesh, const Tree& tree, const OctreeNode& node, Ray3f& ray,
+                       const WatertightRay& wray, bool shadow, PreliminaryIntersection& pi) const
+    {
+        uint32_t begin = node.offset, end = node.offset + node.count;
+        switch(m_leaf_format)
+        {
+            case EVertices:
+                return intersectTriangles(begin, end, ray, shadow, pi, [&](uint32_t j, float& u, float& v, float& t)
+                {
+                    const LeafTriangle& tri = tree.triangles[j];
+                    return m_watertight ? tri.rayIntersectWatertight(ray, wray, u, v, t) : tri.rayIntersect(ray, u, v, t);
+                }, [&](uint32_t j) { return tree.triangles[j].index; });
+            case EAffine:
+                return intersectTriangles(begin, end, ray, shadow, pi, [&](uint32_t j, float& u, float& v, float& t)
+                {
+                    return tree.affine_triangles[j].rayIntersect(ray, u, v, t);
+                }, [&](uint32_t j) { return tree.affine_triangles[j].index; });
+            default:
+                return intersectTriangles(begin, end, ray, shadow, pi, [&](uint32_t j, float& u, float& v, float& t)
+                {
+                    return m_watertight ? mesh->rayIntersectWatertight(tree.indices[j], ray, wray, u, v, t)
+                                        : mesh->rayIntersect(tree.indices[j], ray, u, v, t);
+                }, [&](uint32_t j) { return tree.indices[j]; });
+        }
+    }
+
+    /// Run the ray-triangle test \c test on the leaf triangles <tt>[begin, end)</tt> (see \ref intersectLeaf())
+    template <typename TestFunctor, typename IndexFunctor>
+    static bool intersectTriangles(uint32_t begin, uint32_t end, Ray3f& ray, bool shadow, PreliminaryIntersection& pi,
+                                   const TestFunctor& test, const IndexFunctor& index)
+    {
+        bool found_intersection = false;
+        for(uint32_t j = begin; j < end; ++j)
+        {
+            float u, v, t;
+            if(!test(j, u, v, t))
+                continue;
+            if(shadow)
+                return true;
+            ray.maxt = pi.t = t;
+            pi.uv = Point2f(u, v);
+            pi.f = index(j);
+            found_intersection = true;
+        }
+        return found_intersection;
+    }
+
+    /// Count the number of bits set in the given mask
+    static uint32_t popcount(uint32_t mask)
+    {
+        uint32_t count = 0;
+        for(; mask; mask &= mask - 1)
+            ++count;
+        return count;
+    }
+
+    /**
+     * \brief Return one of the eight octants of a box
+     *
+     * Octant \c i covers the upper half of the parent along axis \c k iff
+     * bit \c k of \c i is set. Visiting the children in the order
+     * <tt>i ^ mask</tt> (where \c mask has a bit set for every negative
+     * ray direction component) therefore enumerates them front to back.
+     */
+    static BoundingBox3f subBox(const BoundingBox3f& bbox, int octant)
+    {
+        Point3f center = bbox.getCenter();
+        BoundingBox3f result;
+        for(int k = 0; k < 3; ++k)
+        {
+            bool upper = (octant >> k) & 1;
+            result.min[k] = upper ? center[k] : bbox.min[k];
+            result.max[k] = upper ? bbox.max[k] : center[k];
+        }
+        return result;
+    }
+
+    /// Split a box into its eight octants (see \ref subBox())
+    static void calSubBox(const BoundingBox3f& bbox, BoundingBox3f* sub_bbox)
+    {
+        for(int i = 0; i < 8; ++i)
+            sub_bbox[i] = subBox(bbox, i);
+    }
+
+    /**
+     * \brief Intersect a ray against all eight octants of a box at once
+     *
+     * The octants share their slab planes, so the ray distances to the three
+     * planes along each axis are computed only once. They are then combined
+     * for all octants in SoA form, using two 4-wide SSE passes when available.
+     *
+     * \return A bit mask of the octants in \c childMask that the ray overlaps
+     * within <tt>[ray.mint, ray.maxt]</tt>. The distances at which it enters
+     * them are stored in \c nearT.
+     */
+    static uint32_t intersectOctants(const SlabRay& ray, float mint, float maxt,
+                                     const BoundingBox3f& bbox, uint32_t childMask, float* nearT)
+    {
+        const float inf = std::numeric_limits<float>::infinity();
+        Point3f center = bbox.getCenter();
+
+        /* Entry and exit distances of the lower and upper half along each
+           axis. The sign of the direction decides which plane of each half
+           is entered first. Distances to planes that contain the origin of a
+           parallel ray are NaN and discarded by std::max(-inf, t) and
+           std::min(inf, t), see SlabRay */
+        float lowerNear[3], lowerFar[3], upperNear[3], upperFar[3];
+        for(int k = 0; k < 3; ++k)
+        {
+            float t0 = (bbox.min[k] - ray.o[k]) * ray.dRcp[k];
+            float t1 = (center[k] - ray.o[k]) * ray.dRcp[k];
+            float t2 = (bbox.max[k] - ray.o[k]) * ray.dRcp[k];
+            bool neg = ray.sign[k] != 0;
+            lowerNear[k] = std::max(-inf, neg ? t1 : t0);
+            lowerFar[k] = std::min(inf, neg ? t0 : t1);
+            upperNear[k] = std::max(-inf, neg ? t2 : t1);
+            upperFar[k] = std::min(inf, neg ? t1 : t2);
+        }
+
+#if defined(NORI_SSE)
+        /* Lanes 0-3 hold the octants in the lower half along Z, lanes 4-7 those in the upper half */
+        __m128 nearXY = _mm_max_ps(
+            _mm_setr_ps(lowerNear[0], upperNear[0], lowerNear[0], upperNear[0]),
+            _mm_setr_ps(lowerNear[1], lowerNear[1], upperNear[1], upperNear[1]));
+        __m128 farXY = _mm_min_ps(
+            _mm_setr_ps(lowerFar[0], upperFar[0], lowerFar[0], upperFar[0]),
+            _mm_setr_ps(lowerFar[1], lowerFar[1], upperFar[1], upperFar[1]));
+        __m128 mint4 = _mm_set1_ps(mint), maxt4 = _mm_set1_ps(maxt);
+
+        __m128 near0 = _mm_max_ps(_mm_max_ps(nearXY, _mm_set1_ps(lowerNear[2])), mint4);
+        __m128 far0  = _mm_min_ps(_mm_min_ps(farXY, _mm_set1_ps(lowerFar[2])), maxt4);
+        __m128 near1 = _mm_max_ps(_mm_max_ps(nearXY, _mm_set1_ps(upperNear[2])), mint4);
+        __m128 far1  = _mm_min_ps(_mm_min_ps(farXY, _mm_set1_ps(upperFar[2])), maxt4);
+
+        _mm_storeu_ps(nearT, near0);
+        _mm_storeu_ps(nearT + 4, near1);
+        uint32_t hitMask = (uint32_t) _mm_movemask_ps(_mm_cmple_ps(near0, far0)) |
+                           ((uint32_t) _mm_movemask_ps(_mm_cmple_ps(near1, far1)) << 4);
+#else
+        uint32_t hitMask = 0;
+        for(int i = 0; i < 8; ++i)
+        {
+            float tNear = mint, tFar = maxt;
+            for(int k = 0; k < 3; ++k)
+            {
+                bool upper = (i >> k) & 1;
+                tNear = std::max(tNear, upper ? upperNear[k] : lowerNear[k]);
+                tFar = std::min(tFar, upper ? upperFar[k] : lowerFar[k]);
+            }
+            nearT[i] = tNear;
+            if(tNear <= tFar)
+                hitMask |= 1u << i;
+        }
+#endif
+
+        return hitMask & childMask;
+    }
+
+protected:
+    /// Maximum depth of the octree
+    static const int MAX_DEPTH_LIMIT = 16;
+    /// Size of the traversal stack (interior nodes have a depth of at most MAX_DEPTH_LIMIT - 1)
+    static const int STACK_SIZE = 7 * MAX_DEPTH_LIMIT + 1;
+    /// Maximum number of triangles in a leaf (see OctreeNode::count)
+    static const uint32_t MAX_LEAF_SIZE = (1u << 24) - 1;
+    /// Nodes with at least this many triangles build their children in parallel
+    static const size_t PARALLEL_THRESHOLD = 4096;
+
+    std::vector<Tree> m_trees;  ///< Octrees of the individual meshes
+    float m_traversal_cost;     ///< Cost of visiting an interior node (testing its children) relative to a triangle test
+    float m_intersection_cost;  ///< Cost of a ray-triangle intersection test
+    int m_max_depth;            ///< Maximum depth of the leaves below the root
+    ELeafFormat m_leaf_format;  ///< Storage of the triangles referenced by the leaves
+};
+
+bool Octree::rayIntersectShape(uint32_t shapeIdx, Ray3f& ray, PreliminaryIntersection& pi) const
+{
+    const Mesh* mesh = m_shapes[shapeIdx];
+    const Tree& tree = m_trees[shapeIdx];
+    const std::vector<OctreeNode>& nodes = tree.nodes;
+    if(nodes.empty())
+        return false;
+
+    bool foundIntersection = false;
+    const BoundingBox3f& bbox = mesh->getBoundingBox();
+
+    SlabRay sray(ray);
+    float nearT, farT;
+    if(!bbox.rayIntersect(ray, nearT, farT) || nearT > ray.maxt || farT < ray.mint)
+        return false;
+
+    /* Octant of the ray direction: children are visited in the order i ^ mask */
+    int mask = (ray.d.x() < 0 ? 1 : 0) | (ray.d.y() < 0 ? 2 : 0) | (ray.d.z() < 0 ? 4 : 0);
+
+    /* Ray-dependent setup of the watertight test (shared by all triangles) */
+    WatertightRay wray;
+    if(m_watertight)
+        wray = WatertightRay(ray);
+
+    /* Fixed-size stack of nodes along with their bounding box and the
+       distance at which the ray enters them. Every interior node on the
+       current path leaves at most seven pending siblings behind, so the
+       size is bounded by the depth */
+    struct StackEntry {
+        uint32_t node;
+        float entryT;
+        BoundingBox3f bbox;
+    } dfs_stack[STACK_SIZE];
+    int stack_size = 0;
+    dfs_stack[stack_size++] = { 0, nearT, bbox };
+
+    while(stack_size > 0)
+    {
+        /* Copy the entry, since the children will overwrite its slot */
+        const StackEntry top = dfs_stack[--stack_size];
+
+        /* Nodes are popped front to back, so all remaining nodes
+           lie behind the closest intersection found so far */
+        if(top.entryT > ray.maxt)
+            break;
+
+        const OctreeNode& node = nodes[top.node];
+        if(node.isLeaf())
+        {
+            if(intersectLeaf(mesh, tree, node, ray, wray, false, pi))
+                foundIntersection = true;
+            continue;
+        }
+
+        float child_near[8];
+        uint32_t hit_mask = intersectOctants(sray, ray.mint, ray.maxt, top.bbox, node.childMask, child_near);
+
+        /* Push the children back to front so that the nearest one is popped first */
+        for(int i = 7; i >= 0; --i)
+        {
+            int octant = i ^ mask;
+            if(hit_mask & (1u << octant))
+                dfs_stack[stack_size++] = { node.child(octant), child_near[octant], subBox(top.bbox, octant) };
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool Octree::occludedShape(uint32_t shapeIdx, const Ray3f& ray) const
+{
+    const Mesh* mesh = m_shapes[shapeIdx];
+    const Tree& tree = m_trees[shapeIdx];
+    const std::vector<OctreeNode>& nodes = tree.nodes;
+    if(nodes.empty())
+        return false;
+
+    const BoundingBox3f& bbox = mesh->getBoundingBox();
+    SlabRay sray(ray);
+    float nearT, farT;
+    if(!bbox.rayIntersect(ray, nearT, farT) || nearT > ray.maxt || farT < ray.mint)
+        return false;
+
+    WatertightRay wray;
+    if(m_watertight)
+        wray = WatertightRay(ray);
+
+    /* The leaf tests take a mutable ray, which shadow rays leave unchanged */
+    Ray3f shadow_ray(ray);
+    PreliminaryIntersection pi;
+
+    /* Any hit terminates the query, so the children are pushed in
+       storage order and their entry distances are not needed */
+    struct StackEntry {
+        uint32_t node;
+        BoundingBox3f bbox;
+    } dfs_stack[STACK_SIZE];
+    int stack_size = 0;
+    dfs_stack[stack_size++] = { 0, bbox };
+
+    while(stack_size > 0)
+    {
+        const StackEntry top = dfs_stack[--stack_size];
+
+        const OctreeNode& node = nodes[top.node];
+        if(node.isLeaf())
+        {
+            if(intersectLeaf(mesh, tree, node, shadow_ray, wray, true, pi))
+                return true;
+            continue;
+        }
+
+        float child_near[8];
+        uint32_t hit_mask = intersectOctants(sray, ray.mint, ray.maxt, top.bbox, node.childMask, child_near);
+        for(int octant = 0; octant < 8; ++octant)
+        {
+            if(hit_mask & (1u << octant))
+                dfs_stack[stack_size++] = { node.child(octant), subBox(top.bbox, octant) };
+        }
+    }
+
+    return false;
+}
+
+NORI_REGISTER_CLASS(Octree, "octree");
+NORI_NAMESPACE_END
@@ -0,0 +1,494 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/textparser.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Loader for PLY triangle meshes
+ *
+ * Supports the \c binary_little_endian and \c ascii variants of the
+ * format. The \c vertex element provides the positions (\c x, \c y, \c z)
+ * and optionally normals (\c nx, \c ny, \c nz) and texture coordinates
+ * (\c u and \c v, or \c s and \c t); its other properties and all other
+ * elements except \c face are skipped. Polygons with more than three
+ * vertices are split into a triangle fan.
+ *
+ * Binary files are memory-mapped and read with bulk copies where the
+ * layout permits: vertices that only consist of \c float positions are
+ * copied with a single \c memcpy(), and triangle lists with one per face.
+ */
+class PLYMesh : public Mesh {
+public:
+    PLYMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        m_filename = filename.str();
+
+        MemoryMappedFile file(m_filename);
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        cout << "Loading \"" << filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        const char *data = (const char *) file.getData();
+        const char *end = data + file.getSize();
+        bool binary;
+        std::vector<Element> elements;
+        const char *ptr = parseHeader(data, end, binary, elements);
+
+        /* Triangle indices, which are copied into m_F at the end */
+        std::vector<uint32_t> indices;
+        for (const Element &element : elements) {
+            if (element.name == "vertex")
+                readVertices(element, ptr, end, binary);
+            else if (element.name == "face")
+                readFaces(element, ptr, end, binary, indices);
+            else
+                skipElement(element, ptr, end, binary);
+        }
+
+        m_F.resize(3, indices.size() / 3);
+        memcpy(m_F.data(), indices.data(), sizeof(uint32_t) * indices.size());
+        if (m_F.size() > 0 && m_F.maxCoeff() >= m_V.cols())
+            throw NoriException("\"%s\" references a vertex that does not exist!", m_filename);
+
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, (uint32_t) m_V.cols()),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i < range.end(); ++i) {
+                    m_V.col(i) = trafo * Point3f(m_V.col(i));
+                    if (m_N.size() > 0)
+                        m_N.col(i) = (trafo * Normal3f(m_N.col(i))).normalized();
+                }
+            }
+        );
+        updateBoundingBox();
+
+        m_name = m_filename;
+        double elapsed = timer.elapsed();
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+             << timeString(elapsed) << " at "
+             << memString((size_t) (file.getSize() / (std::max(elapsed, 1.0) * 1e-3))) << "/s and "
+             << memString(m_F.size() * sizeof(uint32_t) +
+                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+             << ")" << endl;
+    }
+
+protected:
+    /// Scalar types of the PLY format
+    enum EType {
+        EInt8 = 0, EUInt8, EInt16, EUInt16, EInt32, EUInt32, EFloat32, EFloat64
+    };
+
+    /// Property of an element, as declared in the header
+    struct Property {
+        std::string name;
+        EType type;          ///< Type of the value (or of the list entries)
+        bool list = false;   ///< Is this a list?
+        EType countType;     ///< Type of the list size
+        size_t offset = 0;   ///< Offset within a binary record (fixed-size elements only)
+    };
+
+    /// Element, as declared in the header
+    struct Element {
+        std::string name;
+        uint32_t count;
+        std::vector<Property> properties;
+        size_t stride = 0;   ///< Size of a binary record, or 0 if the element contains lists
+    };
+
+    /// Size of the given type in bytes
+    static size_t typeSize(EType type) {
+        static const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+        return sizes[type];
+    }
+
+    /// Parse a type name (including the aliases with explicit sizes)
+    EType parseType(const std::string &name) const {
+        static const char *names[][2] = {
+            { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+            { "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+        };
+        for (int i = 0; i < 8; ++i) {
+            if (name == names[i][0] || name == names[i][1])
+                return (EType) i;
+        }
+        throw NoriException("\"%s\": unknown PLY type \"%s\"!", m_filename, name);
+    }
+
+    /// Read a binary (little endian) value and convert it to a float
+    static float readFloat(const char *ptr, EType type) {
+        switch (type) {
+            case EInt8: return (float) *(const int8_t *) ptr;
+            case EUInt8: return (float) *(const uint8_t *) ptr;
+            case EInt16: { int16_t v; memcpy(&v, ptr, 2); return (float) v; }
+            case EUInt16: { uint16_t v; memcpy(&v, ptr, 2); return (float) v; }
+            case EInt32: { int32_t v; memcpy(&v, ptr, 4); return (float) v; }
+            case EUInt32: { uint32_t v; memcpy(&v, ptr, 4); return (float) v; }
+            case EFloat32: { float v; memcpy(&v, ptr, 4); return v; }
+            default: { double v; memcpy(&v, ptr, 8); return (float) v; }
+        }
+    }
+
+    /// Read a binary (little endian) integer, e.g. a list size or a vertex index
+    static uint32_t readUInt(const char *ptr, EType type) {
+        switch (type) {
+            case EInt8: return (uint32_t) *(const int8_t *) ptr;
+            case EUInt8: return *(const uint8_t *) ptr;
+            case EInt16: { int16_t v; memcpy(&v, ptr, 2); return (uint32_t) v; }
+            case EUInt16: { uint16_t v; memcpy(&v, ptr, 2); return v; }
+            case EInt32:
+            case EUInt32: { uint32_t v; memcpy(&v, ptr, 4); return v; }
+            case EFloat32: return (uint32_t) readFloat(ptr, type);
+            default: return (uint32_t) readFloat(ptr, type);
+        }
+    }
+
+    /// Parse the header and return a pointer to the data that follows it
+    const char *parseHeader(const char *data, const char *end, bool &binary,
+                            std::vector<Element> &elements) const {
+        static const char terminator[] = "end_header";
+        const char *headerEnd = std::search(data, end, terminator, terminator + sizeof(terminator) - 1);
+        if (end - data < 4 || memcmp(data, "ply", 3) != 0 || headerEnd == end)
+            throw NoriException("\"%s\" is not a PLY file!", m_filename);
+        const char *body = (const char *) memchr(headerEnd, '\n', (size_t) (end - headerEnd));
+        body = body ? body + 1 : end;
+
+        bool hasFormat = false;
+        std::vector<std::string> lines = tokenize(std::string(data, headerEnd), "\r\n");
+        for (const std::string &line : lines) {
+            std::vector<std::string> tokens = tokenize(line, " \t");
+            tokens.erase(std::remove(tokens.begin(), tokens.end(), std::string()), tokens.end());
+            if (tokens.empty() || tokens[0] == "ply" || tokens[0] == "comment" || tokens[0] == "obj_info")
+                continue;
+
+            if (tokens[0] == "format" && tokens.size() == 3) {
+                if (tokens[1] == "ascii")
+                    binary = false;
+                else if (tokens[1] == "binary_little_endian")
+                    binary = true;
+                else
+                    throw NoriException("\"%s\": unsupported PLY format \"%s\"!", m_filename, tokens[1]);
+                hasFormat = true;
+            } else if (tokens[0] == "element" && tokens.size() == 3) {
+                Element element;
+                element.name = tokens[1];
+                element.count = toUInt(tokens[2]);
+                elements.push_back(element);
+            } else if (tokens[0] == "property" && !elements.empty() &&
+                       (tokens.size() == 3 || (tokens.size() == 5 && tokens[1] == "list"))) {
+                Property property;
+                property.name = tokens.back();
+                if (tokens.size() == 5) {
+                    property.list = true;
+                    property.countType = parseType(tokens[2]);
+                    property.type = parseType(tokens[3]);
+                } else {
+                    property.type = parseType(tokens[1]);
+                }
+                elements.back().properties.push_back(property);
+            } else {
+                throw NoriException("\"%s\": invalid PLY header line \"%s\"!", m_filename, line);
+            }
+        }
+        if (!hasFormat)
+            throw NoriException("\"%s\": the PLY header does not specify the format!", m_filename);
+
+        /* Offsets of the properties of fixed-size elements */
+        for (Element &element : elements) {
+            size_t offset = 0;
+            bool fixedSize = true;
+            for (Property &property : element.properties) {
+                property.offset = offset;
+                offset += typeSize(property.type);
+                fixedSize &= !property.list;
+            }
+            element.stride = fixedSize ? offset : 0;
+        }
+        return body;
+    }
+
+    /// Return the index of the property with one of the given names, or -1
+    static int findProperty(const Element &element, const char *name, const char *alias = nullptr) {
+        for (size_t i = 0; i < element.properties.size(); ++i) {
+            const std::string &n = element.properties[i].name;
+            if (!element.properties[i].list && (n == name || (alias && n == alias)))
+                return (int) i;
+        }
+        return -1;
+    }
+
+    /// Read the vertex element into m_V, m_N and m_UV
+    void readVertices(const Element &element, const char *&ptr, const char *end, bool binary) {
+        /* Matrix rows that each property is stored in */
+        int props[8] = {
+            findProperty(element, "x"), findProperty(element, "y"), findProperty(element, "z"),
+            findProperty(element, "nx"), findProperty(element, "ny"), findProperty(element, "nz"),
+            findProperty(element, "u", "s"), findProperty(element, "v", "t")
+        };
+        if (props[6] < 0 || props[7] < 0) {
+            props[6] = findProperty(element, "texture_u", "texture_s");
+            props[7] = findProperty(element, "texture_v", "texture_t");
+        }
+        if (props[0] < 0 || props[1] < 0 || props[2] < 0)
+            throw NoriException("\"%s\": the PLY vertices have no positions!", m_filename);
+
+        /* Incomplete normals or texture coordinates are ignored */
+        bool hasNormals = props[3] >= 0 && props[4] >= 0 && props[5] >= 0;
+        bool hasTexcoords = props[6] >= 0 && props[7] >= 0;
+        if (!hasNormals)
+            props[3] = props[4] = props[5] = -1;
+        if (!hasTexcoords)
+            props[6] = props[7] = -1;
+
+        /* Check the size of the data before allocating the mesh. An ASCII
+           value takes at least two bytes including its separator */
+        uint32_t count = element.count;
+        size_t available = (size_t) (end - ptr);
+        if (binary) {
+            if (element.stride == 0)
+                throw NoriException("\"%s\": the PLY vertices contain a list!", m_filename);
+            if (available / element.stride < count)
+                throw NoriException("\"%s\" is truncated!", m_filename);
+        } else if ((available + 1) / 2 / std::max(element.properties.size(), (size_t) 1) < count) {
+            throw NoriException("\"%s\" is truncated!", m_filename);
+        }
+
+        m_V.resize(3, count);
+        if (hasNormals)
+            m_N.resize(3, count);
+        if (hasTexcoords)
+            m_UV.resize(2, count);
+        float *targets[8] = {
+            m_V.data(), m_V.data() + 1, m_V.data() + 2,
+            m_N.data(), m_N.data() + 1, m_N.data() + 2,
+            m_UV.data(), m_UV.data() + 1
+        };
+        int strides[8] = { 3, 3, 3, 3, 3, 3, 2, 2 };
+
+        if (!binary) {
+            std::vector<float> values(element.properties.size());
+            TextParser parser(ptr, end);
+            for (uint32_t i = 0; i < count; ++i) {
+                readASCIIRecord(element, parser, values.data());
+                for (int k = 0; k < 8; ++k) {
+                    if (props[k] >= 0)
+                        targets[k][(size_t) i * strides[k]] = values[props[k]];
+                }
+            }
+            ptr = parser.getPosition();
+            return;
+        }
+
+        /* Bulk copy for vertices that consist of exactly x, y, z as floats */
+        if (element.properties.size() == 3 && props[0] == 0 && props[1] == 1 && props[2] == 2 &&
+            element.properties[0].type == EFloat32 && element.properties[1].type == EFloat32 &&
+            element.properties[2].type == EFloat32) {
+            memcpy(m_V.data(), ptr, sizeof(float) * 3 * count);
+        } else {
+            tbb::parallel_for(tbb::blocked_range<uint32_t>(0, count),
+                [&](const tbb::blocked_range<uint32_t> &range) {
+                    for (uint32_t i = range.begin(); i < range.end(); ++i) {
+                        const char *record = ptr + (size_t) i * element.stride;
+                        for (int k = 0; k < 8; ++k) {
+                            if (props[k] < 0)
+                                continue;
+                            const Property &property = element.properties[props[k]];
+                            targets[k][(size_t) i * strides[k]] = readFloat(record + property.offset, property.type);
+                        }
+                    }
+                }
+            );
+        }
+        ptr += (size_t) element.stride * count;
+    }
+
+    /// Read the face element and append its triangles to \c indices
+    void readFaces(const Element &element, const char *&ptr, const char *end, bool binary,
+                   std::vector<uint32_t> &indices) const {
+        int listIndex = -1;
+        for (size_t i = 0; i < element.properties.size(); ++i) {
+            const Property &property = element.properties[i];
+            if (property.list && (property.name == "vertex_indices" || property.name == "vertex_index"))
+                listIndex = (int) i;
+        }
+        if (listIndex < 0)
+            throw NoriException("\"%s\": the PLY faces have no vertex indices!", m_filename);
+        const Property &list = element.properties[listIndex];
+
+        /* Every face takes at least one byte, which bounds the reservation for corrupt counts */
+        indices.reserve(indices.size() + 3 * std::min((size_t) element.count, (size_t) (end - ptr)));
+        uint32_t polygon[3];
+        auto addIndex = [&](uint32_t j, uint32_t index) {
+            /* Index j > 2 adds the triangle (0, j - 1, j) */
+            if (j < 3) {
+                polygon[j] = index;
+                if (j == 2)
+                    indices.insert(indices.end(), polygon, polygon + 3);
+            } else {
+                indices.push_back(polygon[0]);
+                indices.push_back(polygon[2]);
+                indices.push_back(index);
+                polygon[2] = index;
+            }
+        };
+
+        if (!binary) {
+            TextParser parser(ptr, end);
+            for (uint32_t i = 0; i < element.count; ++i) {
+                for (size_t k = 0; k < element.properties.size(); ++k) {
+                    const Property &property = element.properties[k];
+                    uint32_t size = 1;
+                    if (property.list && !readASCIIUInt(parser, size))
+                        throw NoriException("\"%s\": invalid PLY list size!", m_filename);
+                    if ((int) k == listIndex && size < 3)
+                        throw NoriException("\"%s\": PLY face with less than three vertices!", m_filename);
+                    for (uint32_t j = 0; j < size; ++j) {
+                        uint32_t index;
+                        float value;
+                        if ((int) k == listIndex) {
+                            if (!readASCIIUInt(parser, index))
+                                throw NoriException("\"%s\": invalid PLY vertex index!", m_filename);
+                            addIndex(j, index);
+                        } else {
+                            parser.skipWhitespace();
+                            if (!parser.parseFloat(value))
+                                throw NoriException("\"%s\": invalid PLY value!", m_filename);
+                        }
+                    }
+                }
+            }
+            ptr = parser.getPosition();
+            return;
+        }
+
+        /* Bulk copy for faces that only consist of triangles with 32-bit indices */
+        size_t countSize = typeSize(list.countType), indexSize = typeSize(list.type);
+        bool fastPath = element.properties.size() == 1 && (list.type == EInt32 || list.type == EUInt32);
+        for (uint32_t i = 0; i < element.count; ++i) {
+            for (size_t k = 0; k < element.properties.size(); ++k) {
+                const Property &property = element.properties[k];
+                if (!property.list) {
+                    if ((size_t) (end - ptr) < typeSize(property.type))
+                        throw NoriException("\"%s\" is truncated!", m_filename);
+                    ptr += typeSize(property.type);
+                    continue;
+                }
+
+                if ((size_t) (end - ptr) < countSize)
+                    throw NoriException("\"%s\" is truncated!", m_filename);
+                uint32_t size = readUInt(ptr, property.countType);
+                ptr += countSize;
+                size_t itemSize = typeSize(property.type);
+                if ((size_t) (end - ptr) / itemSize < size)
+                    throw NoriException("\"%s\" is truncated!", m_filename);
+
+                if ((int) k == listIndex) {
+                    if (size < 3)
+                        throw NoriException("\"%s\": PLY face with less than three vertices!", m_filename);
+                    if (fastPath && size == 3) {
+                        size_t offset = indices.size();
+                        indices.resize(offset + 3);
+                        memcpy(&indices[offset], ptr, 3 * sizeof(uint32_t));
+                    } else {
+                        for (uint32_t j = 0; j < size; ++j)
+                            addIndex(j, readUInt(ptr + j * indexSize, property.type));
+                    }
+                }
+                ptr += (size_t) size * itemSize;
+            }
+        }
+    }
+
+    /// Skip an element that is not used by the mesh
+    void skipElement(const Element &element, const char *&ptr, const char *end, bool binary) const {
+        if (!binary) {
+            TextParser parser(ptr, end);
+            std::vector<float> values(element.properties.size());
+            for (uint32_t i = 0; i < element.count; ++i)
+                readASCIIRecord(element, parser, values.data());
+            ptr = parser.getPosition();
+            return;
+        }
+
+        if (element.stride > 0) {
+            if ((size_t) (end - ptr) / element.stride < element.count)
+                throw NoriException("\"%s\" is truncated!", m_filename);
+            ptr += (size_t) element.stride * element.count;
+            return;
+        }
+
+        for (uint32_t i = 0; i < element.count; ++i) {
+            for (const Property &property : element.properties) {
+                size_t size = property.list ? typeSize(property.countType) : typeSize(property.type);
+                if ((size_t) (end - ptr) < size)
+                    throw NoriException("\"%s\" is truncated!", m_filename);
+                if (property.list) {
+                    uint32_t count = readUInt(ptr, property.countType);
+                    ptr += size;
+                    size = (size_t) count * typeSize(property.type);
+                    if ((size_t) (end - ptr) < size)
+                        throw NoriException("\"%s\" is truncated!", m_filename);
+                }
+                ptr += size;
+            }
+        }
+    }
+
+    /**
+     * \brief Read an ASCII record of an element into \c values (one per property)
+     *
+     * Lists are skipped, their entries in \c values are left unchanged.
+     */
+    void readASCIIRecord(const Element &element, TextParser &parser, float *values) const {
+        for (size_t k = 0; k < element.properties.size(); ++k) {
+            const Property &property = element.properties[k];
+            uint32_t size = 1;
+            if (property.list && !readASCIIUInt(parser, size))
+                throw NoriException("\"%s\": invalid PLY list size!", m_filename);
+            for (uint32_t j = 0; j < size; ++j) {
+                float value;
+                parser.skipWhitespace();
+                if (!parser.parseFloat(value))
+                    throw NoriException("\"%s\": invalid PLY value!", m_filename);
+                if (!property.list)
+                    values[k] = value;
+            }
+        }
+    }
+
+    /// Read an unsigned integer from an ASCII file
+    static bool readASCIIUInt(TextParser &parser, uint32_t &value) {
+        parser.skipWhitespace();
+        return parser.parseUInt(value);
+    }
+
+protected:
+    std::string m_filename;  ///< Name of the file (for error messages)
+};
+
+NORI_REGISTER_CLASS(PLYMesh, "ply");
+NORI_NAMESPACE_END
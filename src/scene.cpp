@@ -22,28 +22,19 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
-#include <nori/octreenode.h>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
-}
+Scene::Scene(const PropertyList &) { }
 
 Scene::~Scene() {
     delete m_accel;
     delete m_sampler;
     delete m_camera;
     delete m_integrator;
-    delete m_root;
 }
 
 void Scene::activate() {
-    //m_accel->build();
-    m_accel->init_triangle_idx(m_accel->getTriCount());
-    m_root = m_accel->build(m_accel->getBoundingBox(), m_accel->triangle_idx, &(m_accel->total_leaf), &(m_accel->total_interior));
-   
-
     if (!m_integrator)
         throw NoriException("No integrator was specified!");
     if (!m_camera)
@@ -55,6 +46,16 @@ void Scene::activate() {
             NoriObjectFactory::createInstance("independent", PropertyList()));
     }
 
+    if (!m_accel) {
+        /* Create a default (BVH) acceleration data structure */
+        m_accel = static_cast<Accel*>(
+            NoriObjectFactory::createInstance("bvh", PropertyList()));
+    }
+
+    for (Mesh *mesh : m_meshes)
+        m_accel->addMesh(mesh);
+    m_accel->build();
+
     cout << endl;
     cout << "Configuration: " << toString() << endl;
     cout << endl;
@@ -64,7 +65,6 @@ void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Mesh *mesh = static_cast<Mesh *>(obj);
-                m_accel->addMesh(mesh);
                 m_meshes.push_back(mesh);
             }
             break;
@@ -94,6 +94,12 @@ void Scene::addChild(NoriObject *obj) {
             m_integrator = static_cast<Integrator *>(obj);
             break;
 
+        case EAccel:
+            if (m_accel)
+                throw NoriException("There can only be one acceleration data structure per scene!");
+            m_accel = static_cast<Accel *>(obj);
+            break;
+
         default:
             throw NoriException("Scene::addChild(<%s>) is not supported!",
                 classTypeName(obj->getClassType()));
@@ -114,12 +120,14 @@ std::string Scene::toString() const {
         "  integrator = %s,\n"
         "  sampler = %s\n"
         "  camera = %s,\n"
+        "  accel = %s,\n"
         "  meshes = {\n"
         "  %s  }\n"
         "]",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
+        indent(m_accel->toString()),
         indent(meshes, 2)
     );
 }
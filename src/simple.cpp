@@ -28,7 +28,7 @@ class SimpleIntegrator : public Integrator
         diff = diff / std::sqrt(norm_diff);
         float cos = (normal.x() * diff.x() + normal.y() * diff.y() + normal.z() * diff.z());
         Ray3f vis(x, diff);
-        if(scene->rayIntersect(vis))
+        if(scene->occluded(vis))
         {
             return Color3f(0, 0, 0);
         }
@@ -0,0 +1,235 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/object.h>
+#include <nori/bbox.h>
+#include <nori/timer.h>
+#include <pcg32.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Checks the branchless ray-box slab test against the original
+ * implementation and compares their performance
+ *
+ * The rays and boxes are generated on a coarse grid, so that many rays are
+ * parallel to the slabs (with direction components of +0 or -0), start on
+ * the boundary of a box, or pass through its edges and corners. Flat and
+ * empty boxes are included as well. Both \ref TBoundingBox::rayIntersect()
+ * variants must agree with the reference on every ray, except that empty
+ * boxes must never be hit. Afterwards, each
+ * ray is tested against a set of boxes with the reference, with the
+ * branchless test, and with the branchless test using a \ref SlabRay that
+ * is computed once per ray, and the throughput is reported.
+ */
+class SlabTest : public NoriObject {
+public:
+    SlabTest(const PropertyList &propList) {
+        /* Number of rays that should be tested (default: 1M) */
+        m_rayCount = propList.getInteger("rayCount", 1000000);
+
+        /* Number of boxes that each ray is tested against in the benchmark (default: 64) */
+        m_boxCount = propList.getInteger("boxCount", 64);
+    }
+
+    /// Run the test
+    void activate() {
+        pcg32 random;
+        std::vector<Ray3f> rays;
+        std::vector<BoundingBox3f> boxes;
+        rays.reserve(m_rayCount);
+        boxes.reserve(m_rayCount);
+        for (int i = 0; i < m_rayCount; ++i) {
+            rays.push_back(sampleRay(random));
+            boxes.push_back(sampleBox(random));
+        }
+
+        int mismatches = 0;
+        for (int i = 0; i < m_rayCount; ++i) {
+            const Ray3f &ray = rays[i];
+            const BoundingBox3f &bbox = boxes[i];
+            float nearT, farT, refNearT, refFarT;
+
+            /* The reference reports all rays as hitting an empty box, whose
+               slabs are [+inf, -inf]. The branchless test does not */
+            if (!bbox.isValid()) {
+                if (bbox.rayIntersect(ray, nearT, farT) || bbox.rayIntersect(ray))
+                    ++mismatches;
+                continue;
+            }
+
+            bool expected = referenceRayIntersect(bbox, ray, refNearT, refFarT);
+            bool hit = bbox.rayIntersect(ray, nearT, farT);
+            if (hit != expected || (hit && (nearT != refNearT || farT != refFarT)))
+                ++mismatches;
+
+            expected = expected && ray.mint <= refFarT && refNearT <= ray.maxt;
+            if (bbox.rayIntersect(ray) != expected ||
+                bbox.rayIntersect(SlabRay(ray), ray.mint, ray.maxt) != expected)
+                ++mismatches;
+        }
+
+        cout << tfm::format("Correctness: %i/%i rays agree with the reference slab test",
+            m_rayCount - mismatches, m_rayCount) << endl;
+
+        /* Benchmark with the first boxes, which stay in the cache */
+        int boxCount = std::min(m_boxCount, m_rayCount);
+        benchmark("Reference slab test", rays, boxes, boxCount,
+            [&](const Ray3f &ray, const BoundingBox3f *boxes, int count) {
+                uint32_t hits = 0;
+                for (int j = 0; j < count; ++j) {
+                    float nearT, farT;
+                    hits += referenceRayIntersect(boxes[j], ray, nearT, farT) &&
+                            ray.mint <= farT && nearT <= ray.maxt;
+                }
+                return hits;
+            });
+        benchmark("Branchless slab test", rays, boxes, boxCount,
+            [&](const Ray3f &ray, const BoundingBox3f *boxes, int count) {
+                uint32_t hits = 0;
+                for (int j = 0; j < count; ++j)
+                    hits += boxes[j].rayIntersect(ray);
+                return hits;
+            });
+        benchmark("Branchless slab test (precomputed)", rays, boxes, boxCount,
+            [&](const Ray3f &ray, const BoundingBox3f *boxes, int count) {
+                SlabRay sray(ray);
+                uint32_t hits = 0;
+                for (int j = 0; j < count; ++j)
+                    hits += boxes[j].rayIntersect(sray, ray.mint, ray.maxt);
+                return hits;
+            });
+
+        if (mismatches > 0)
+            throw std::runtime_error("Some tests failed :(");
+        cout << "Passed 1/1 tests." << endl;
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "SlabTest[\n"
+            "  rayCount = %i,\n"
+            "  boxCount = %i\n"
+            "]",
+            m_rayCount,
+            m_boxCount
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+
+protected:
+    /// Return a coordinate on a coarse grid in [-2, 2]
+    static float sampleCoordinate(pcg32 &random) {
+        return (int) random.nextUInt(9) * 0.5f - 2.0f;
+    }
+
+    /// Sample a box with corners on the grid (some of them flat or empty)
+    static BoundingBox3f sampleBox(pcg32 &random) {
+        if (random.nextUInt(32) == 0)
+            return BoundingBox3f();
+        BoundingBox3f bbox;
+        for (int k = 0; k < 3; ++k) {
+            float a = sampleCoordinate(random), b = sampleCoordinate(random);
+            bbox.min[k] = std::min(a, b);
+            bbox.max[k] = std::max(a, b);
+        }
+        return bbox;
+    }
+
+    /// Sample a ray starting on the grid, with some direction components set to +0 or -0
+    static Ray3f sampleRay(pcg32 &random) {
+        Point3f o;
+        Vector3f d;
+        do {
+            for (int k = 0; k < 3; ++k) {
+                o[k] = sampleCoordinate(random);
+                uint32_t type = random.nextUInt(4);
+                if (type == 0)
+                    d[k] = random.nextUInt(2) ? 0.0f : -0.0f;
+                else if (type == 1)
+                    d[k] = sampleCoordinate(random);
+                else
+                    d[k] = 2 * random.nextFloat() - 1;
+            }
+        } while (d.squaredNorm() == 0);
+
+        /* Also test finite segments, some of which start behind the origin */
+        float mint = random.nextUInt(2) ? Epsilon : 4 * random.nextFloat() - 2;
+        float maxt = random.nextUInt(2) ? std::numeric_limits<float>::infinity()
+                                        : mint + 4 * random.nextFloat();
+        return Ray3f(o, d.normalized(), mint, maxt);
+    }
+
+    /// Slab test of TBoundingBox::rayIntersect() before it was made branchless
+    static bool referenceRayIntersect(const BoundingBox3f &bbox, const Ray3f &ray,
+                                      float &nearT, float &farT) {
+        nearT = -std::numeric_limits<float>::infinity();
+        farT = std::numeric_limits<float>::infinity();
+
+        for (int i=0; i<3; i++) {
+            float origin = ray.o[i];
+            float minVal = bbox.min[i], maxVal = bbox.max[i];
+
+            if (ray.d[i] == 0) {
+                if (origin < minVal || origin > maxVal)
+                    return false;
+            } else {
+                float t1 = (minVal - origin) * ray.dRcp[i];
+                float t2 = (maxVal - origin) * ray.dRcp[i];
+
+                if (t1 > t2)
+                    std::swap(t1, t2);
+
+                t2 *= 1.0f + 6.0f * std::numeric_limits<float>::epsilon();
+
+                nearT = std::max(t1, nearT);
+                farT = std::min(t2, farT);
+
+                if (!(nearT <= farT))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    /// Test every ray against the first boxes on a single thread and report the throughput
+    template <typename Query>
+    void benchmark(const char *name, const std::vector<Ray3f> &rays,
+                   const std::vector<BoundingBox3f> &boxes, int boxCount,
+                   const Query &query) const {
+        Timer timer;
+        uint64_t hits = 0;
+        for (const Ray3f &ray : rays)
+            hits += query(ray, boxes.data(), boxCount);
+        double elapsed = timer.elapsed();
+
+        uint64_t tests = (uint64_t) rays.size() * boxCount;
+        cout << tfm::format("%s: %.2f Mtests/s (%i tests, %i hits, took %s)",
+            name, tests / (1000.0 * std::max(elapsed, 1.0)), tests, hits,
+            timeString(elapsed)) << endl;
+    }
+
+protected:
+    int m_rayCount;
+    int m_boxCount;
+};
+
+NORI_REGISTER_CLASS(SlabTest, "slabtest");
+NORI_NAMESPACE_END
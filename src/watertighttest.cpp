@@ -0,0 +1,304 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/scene.h>
+#include <nori/warp.h>
+#include <nori/timer.h>
+#include <Eigen/Geometry>
+#include <tbb/parallel_for.h>
+#include <pcg32.h>
+#include <atomic>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Checks that rays cannot slip through the edges and vertices
+ * shared by adjacent triangles
+ *
+ * For each of the provided scenes, this test aims rays at points on interior
+ * edges (shared by exactly two triangles) and at interior vertices of the
+ * meshes. Each ray approaches the target from a direction in which all
+ * triangles around the target face the same way, so that their projections
+ * along the ray cover a neighborhood of the target: a correct ray-triangle
+ * test must report a hit for every single ray. Each ray starts at some
+ * distance from the target, but only a short segment around the target is
+ * tested, so that a ray that slips through cannot be caught by the far side
+ * of a closed mesh, and geometry in front of the target cannot hide a leak.
+ * Rays are traced as closest-hit queries and as shadow ray (any hit)
+ * queries, which must agree on every ray.
+ *
+ * Half of the rays are aimed at edges, the other half at vertices. Scenes
+ * whose acceleration data structure uses the watertight ray-triangle test
+ * must not miss any of them. For all other scenes, the number of misses is
+ * only reported.
+ */
+class WatertightTest : public NoriObject {
+public:
+    WatertightTest(const PropertyList &propList) {
+        /* Number of rays that should be traced per scene (default: 1M) */
+        m_rayCount = propList.getInteger("rayCount", 1000000);
+    }
+
+    virtual ~WatertightTest() {
+        for (auto scene : m_scenes)
+            delete scene;
+    }
+
+    void addChild(NoriObject *obj) {
+        switch (obj->getClassType()) {
+            case EScene:
+                m_scenes.push_back(static_cast<Scene *>(obj));
+                break;
+
+            default:
+                throw NoriException("WatertightTest::addChild(<%s>) is not supported!",
+                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    /// Run the test on each of the provided scenes
+    void activate() {
+        int total = 0, passed = 0;
+
+        for (auto scene : m_scenes) {
+            cout << "------------------------------------------------------" << endl;
+            cout << "Testing: " << scene->getAccel()->toString() << endl;
+
+            Targets targets;
+            for (const Mesh *mesh : scene->getMeshes()) {
+                /* Instances store no triangles of their own */
+                if (!mesh->getInstancedMesh())
+                    findTargets(mesh, targets);
+            }
+
+            if (targets.edges.empty() || targets.vertices.empty())
+                throw NoriException("WatertightTest: the scene does not contain any "
+                                    "interior edges or vertices!");
+
+            float distance = 0.1f * scene->getBoundingBox().getExtents().norm();
+            bool watertight = scene->getAccel()->isWatertight();
+
+            for (int vertexRays = 0; vertexRays < 2; ++vertexRays) {
+                int rayCount = vertexRays ? m_rayCount - m_rayCount / 2 : m_rayCount / 2;
+                std::vector<Ray3f> rays;
+                rays.reserve(rayCount);
+                pcg32 random;
+                int skipped = 0;
+
+                for (int i = 0; i < rayCount; ++i) {
+                    Point3f target;
+                    const Normal3f *normals, *normalsEnd;
+
+                    if (vertexRays) {
+                        const Vertex &vertex = targets.vertices[random.nextUInt((uint32_t) targets.vertices.size())];
+                        target = vertex.p;
+                        normals = targets.normals.data() + vertex.normalOffset;
+                        normalsEnd = normals + vertex.normalCount;
+                    } else {
+                        const Edge &edge = targets.edges[random.nextUInt((uint32_t) targets.edges.size())];
+                        float s = 0.05f + 0.9f * random.nextFloat();
+                        target = (1 - s) * edge.p0 + s * edge.p1;
+                        normals = edge.n;
+                        normalsEnd = edge.n + 2;
+                    }
+
+                    /* Find a direction from which all adjacent triangles face the same way.
+                       There is none if the triangles fold over too sharply (or around a saddle
+                       vertex), so such targets are skipped after a number of tries. */
+                    Vector3f d;
+                    bool found = false;
+                    for (int tries = 0; tries < MaxDirectionTries && !found; ++tries) {
+                        d = Warp::squareToUniformSphere(Point2f(random.nextFloat(), random.nextFloat()));
+                        bool front = true, back = true;
+                        for (const Normal3f *n = normals; n != normalsEnd; ++n) {
+                            float cosTheta = d.dot(*n);
+                            front &= cosTheta < -0.1f;
+                            back &= cosTheta > 0.1f;
+                        }
+                        found = front || back;
+                    }
+
+                    if (!found) {
+                        ++skipped;
+                        continue;
+                    }
+
+                    rays.emplace_back(target - d * distance, d,
+                                      distance * (1 - SegmentLength), distance * (1 + SegmentLength));
+                }
+
+                if (skipped > 0)
+                    cout << tfm::format("Skipped %i/%i %s targets without a suitable ray direction",
+                        skipped, rayCount, vertexRays ? "vertex" : "edge") << endl;
+                rayCount = (int) rays.size();
+
+                std::atomic<int> misses(0), shadowMisses(0), mismatches(0);
+                Timer timer;
+                tbb::parallel_for(0, rayCount, [&](int i) {
+                    PreliminaryIntersection pi;
+                    bool hit = scene->rayIntersect(rays[i], pi);
+                    bool occluded = scene->occluded(rays[i]);
+                    misses += !hit;
+                    shadowMisses += !occluded;
+                    mismatches += hit != occluded;
+                });
+
+                cout << tfm::format("%s rays: %i/%i missed, %i/%i shadow rays missed (took %s)",
+                    vertexRays ? "Vertex" : "Edge", (int) misses, rayCount,
+                    (int) shadowMisses, rayCount, timer.elapsedString()) << endl;
+
+                /* Both queries use the same ray-triangle test, so they must agree */
+                ++total;
+                if (mismatches == 0)
+                    ++passed;
+                else
+                    cout << tfm::format("%i rays were reported differently by the shadow ray query!",
+                        (int) mismatches) << endl;
+
+                if (watertight) {
+                    ++total;
+                    if (misses == 0 && shadowMisses == 0)
+                        ++passed;
+                    else
+                        cout << "Rays slipped through the mesh!" << endl;
+                }
+            }
+        }
+
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+        if (passed < total)
+            throw std::runtime_error("Some tests failed :(");
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "WatertightTest[\n"
+            "  rayCount = %i\n"
+            "]",
+            m_rayCount
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+
+protected:
+    /// Half the length of the tested segment around the target (relative to the distance of the ray origin)
+    static constexpr float SegmentLength = 1e-3f;
+
+    /// Number of random directions that are tried for each target before it is skipped
+    static constexpr int MaxDirectionTries = 1000;
+
+    /// Interior edge along with the normals of its two triangles
+    struct Edge {
+        Point3f p0, p1;
+        Normal3f n[2];
+    };
+
+    /// Interior vertex along with a range of normals of its triangles
+    struct Vertex {
+        Point3f p;
+        uint32_t normalOffset;
+        uint32_t normalCount;
+    };
+
+    /// Points that rays are aimed at
+    struct Targets {
+        std::vector<Edge> edges;
+        std::vector<Vertex> vertices;
+        std::vector<Normal3f> normals;
+    };
+
+    /**
+     * \brief Collect the interior edges and vertices of a mesh
+     *
+     * Vertices are identified by their position, since meshes loaded from
+     * OBJ files duplicate vertices that have different normals or texture
+     * coordinates.
+     */
+    void findTargets(const Mesh *mesh, Targets &targets) const {
+        const MatrixXf &V = mesh->getVertexPositions();
+        const MatrixXu &F = mesh->getIndices();
+
+        /* Map each vertex to a canonical index based on its position */
+        auto less = [](const Point3f &a, const Point3f &b) {
+            return std::lexicographical_compare(a.data(), a.data() + 3, b.data(), b.data() + 3);
+        };
+        std::map<Point3f, uint32_t, decltype(less)> positionIndex(less);
+        std::vector<uint32_t> canonical(V.cols());
+        std::vector<Point3f> positions;
+        for (uint32_t i = 0; i < (uint32_t) V.cols(); ++i) {
+            auto result = positionIndex.insert(std::make_pair(Point3f(V.col(i)), (uint32_t) positions.size()));
+            if (result.second)
+                positions.push_back(V.col(i));
+            canonical[i] = result.first->second;
+        }
+
+        /* Adjacent (non-degenerate) triangles of each edge and vertex */
+        std::map<std::pair<uint32_t, uint32_t>, std::vector<uint32_t>> edgeFaces;
+        std::vector<std::vector<uint32_t>> vertexFaces(positions.size());
+        std::vector<Normal3f> faceNormals(F.cols());
+        for (uint32_t f = 0; f < (uint32_t) F.cols(); ++f) {
+            uint32_t idx[3] = { canonical[F(0, f)], canonical[F(1, f)], canonical[F(2, f)] };
+            Vector3f n = (positions[idx[1]] - positions[idx[0]]).cross(positions[idx[2]] - positions[idx[0]]);
+            if (n.squaredNorm() == 0 || idx[0] == idx[1] || idx[1] == idx[2] || idx[2] == idx[0])
+                continue;
+            faceNormals[f] = n.normalized();
+
+            for (int k = 0; k < 3; ++k) {
+                uint32_t a = idx[k], b = idx[(k + 1) % 3];
+                edgeFaces[std::make_pair(std::min(a, b), std::max(a, b))].push_back(f);
+                vertexFaces[a].push_back(f);
+            }
+        }
+
+        /* Vertices on the boundary (or on non-manifold edges) are not interior */
+        std::vector<bool> interior(positions.size(), true);
+        for (const auto &edge : edgeFaces) {
+            if (edge.second.size() == 2) {
+                Edge target;
+                target.p0 = positions[edge.first.first];
+                target.p1 = positions[edge.first.second];
+                target.n[0] = faceNormals[edge.second[0]];
+                target.n[1] = faceNormals[edge.second[1]];
+                targets.edges.push_back(target);
+            } else {
+                interior[edge.first.first] = interior[edge.first.second] = false;
+            }
+        }
+
+        for (uint32_t i = 0; i < (uint32_t) positions.size(); ++i) {
+            if (!interior[i] || vertexFaces[i].empty())
+                continue;
+            Vertex target;
+            target.p = positions[i];
+            target.normalOffset = (uint32_t) targets.normals.size();
+            target.normalCount = (uint32_t) vertexFaces[i].size();
+            for (uint32_t f : vertexFaces[i])
+                targets.normals.push_back(faceNormals[f]);
+            targets.vertices.push_back(target);
+        }
+    }
+
+private:
+    std::vector<Scene *> m_scenes;
+    int m_rayCount;
+};
+
+NORI_REGISTER_CLASS(WatertightTest, "watertight");
+NORI_NAMESPACE_END